@@ -9,307 +9,2461 @@
 
 #include "asset.h"
 #include "assetpack.h"
+#include "compression.h"
+#include "checksum.h"
+#include "blockcompression.h"
 #include <algorithm>
+#include <tuple>
+#include <cmath>
+#include <limits>
+#include <cstring>
 #include <cassert>
+#include <condition_variable>
 #include <iostream>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_SIMD_MATCH
+#endif
+
 using namespace std;
 
 namespace
 {
+  const size_t CoalesceGap = 64*1024;
+  const size_t CoalesceLimit = 8*1024*1024;
+
+  const size_t MatchTagLimit = 8;
+  const size_t MatchTieLimit = 16;
+
+  const size_t MemoSize = 1024;
+
+  const size_t CompactBudget = 4*1024*1024; // bytes moved per call to compact
+
+  ///////////////////////// image_datasize ////////////////////////////////////
+  size_t image_datasize(uint32_t format, uint32_t width, uint32_t height)
+  {
+    switch (static_cast<PackImageFormat>(format))
+    {
+      case PackImageFormat::A8:
+        return width * height * sizeof(uint8_t);
+
+      case PackImageFormat::BC1:
+        return block_compressed_size(BlockFormat::BC1, width, height);
+
+      case PackImageFormat::BC3:
+        return block_compressed_size(BlockFormat::BC3, width, height);
+
+      case PackImageFormat::BC7:
+        return block_compressed_size(BlockFormat::BC7, width, height);
+
+      default:
+        return width * height * sizeof(uint32_t);
+    }
+  }
+
+
+  ///////////////////////// read_image_header /////////////////////////////////
+  void read_image_header(Asset &asset, PackImageHeader const &ihdr)
+  {
+    asset.info.width = ihdr.width;
+    asset.info.height = ihdr.height;
+    asset.info.aspect = (float)asset.info.width / (float)asset.info.height;
+    asset.info.alignx = ihdr.alignx;
+    asset.info.aligny = ihdr.aligny;
+    asset.datapos = ihdr.dataoffset;
+    asset.level = ihdr.level;
+    asset.header = 0x52444849; // IHDR
+    asset.info.levels = 1;
+    asset.info.format = ihdr.format;
+    asset.datasize = image_datasize(ihdr.format, ihdr.width, ihdr.height);
+    asset.codec = ihdr.codec;
+    asset.packedsize = (ihdr.codec != 0) ? ihdr.packedsize : asset.datasize;
+    asset.datahash = ihdr.datahash;
+    asset.checksum = ihdr.checksum;
+  }
+
+
+  ///////////////////////// read_font_header //////////////////////////////////
+  void read_font_header(Asset &asset, PackFontHeader const &fhdr)
+  {
+    asset.info.ascent = fhdr.ascent;
+    asset.info.descent = fhdr.descent;
+    asset.info.leading = fhdr.leading;
+    asset.level = 0;
+    asset.header = 0x52444846; // FHDR
+    asset.datapos = fhdr.dataoffset;
+    asset.datasize = fhdr.datasize;
+    asset.codec = fhdr.codec;
+    asset.packedsize = (fhdr.codec != 0) ? fhdr.packedsize : asset.datasize;
+    asset.datahash = fhdr.datahash;
+    asset.checksum = fhdr.checksum;
+  }
+
+
+  ///////////////////////// read_asset_toc ////////////////////////////////////
+  bool read_asset_toc(HandmadePlatform::PlatformInterface &platform, HandmadePlatform::PlatformInterface::handle_t handle, std::vector<Asset, StackAllocator<Asset>> &assets)
+  {
+    PackChunk chunk;
+
+    platform.read_handle(handle, sizeof(PackHeader), &chunk, sizeof(chunk));
+
+    if (chunk.type != 0x434f5441) // ATOC
+      return false;
+
+    std::vector<char, StackAllocator<char>> buffer(chunk.length, assets.get_allocator());
+
+    platform.read_handle(handle, sizeof(PackHeader) + sizeof(chunk), buffer.data(), buffer.size());
+
+    auto toc = reinterpret_cast<PackTocHeader const *>(buffer.data());
+
+    if (chunk.length < sizeof(PackTocHeader))
+      throw runtime_error("Invalid asset toc");
+
+    // toc from an older layout, fall back to the chunk walk
+
+    if (chunk.length != sizeof(PackTocHeader) + toc->assetcount * sizeof(PackTocEntry) + toc->tagcount * sizeof(PackAssetTag))
+      return false;
+
+    auto entries = reinterpret_cast<PackTocEntry const *>(buffer.data() + sizeof(PackTocHeader));
+    auto tags = reinterpret_cast<PackAssetTag const *>(buffer.data() + sizeof(PackTocHeader) + toc->assetcount * sizeof(PackTocEntry));
+
+    Asset asset(assets.get_allocator());
+
+    asset.filehandle = handle;
+
+    for(size_t i = 0; i < toc->assetcount; ++i)
+    {
+      auto &entry = entries[i];
+
+      if (entry.tagindex + entry.tagcount > toc->tagcount)
+        throw runtime_error("Invalid asset toc");
+
+      asset.type = static_cast<AssetType>(entry.type);
+
+      asset.tags = {};
+
+      for(size_t k = entry.tagindex; k < entry.tagindex + entry.tagcount; ++k)
+      {
+        asset.tags.push_back({ static_cast<AssetTagId>(tags[k].id), tags[k].value });
+      }
+
+      switch (entry.header)
+      {
+        case 0x52444849: // IHDR
+          read_image_header(asset, entry.ihdr);
+          break;
+
+        case 0x52444846: // FHDR
+          read_font_header(asset, entry.fhdr);
+          break;
+      }
+
+      assets.push_back(asset);
+    }
+
+    return true;
+  }
+
+
+  ///////////////////////// read_asset_chunks /////////////////////////////////
+  void read_asset_chunks(HandmadePlatform::PlatformInterface &platform, HandmadePlatform::PlatformInterface::handle_t handle, std::vector<Asset, StackAllocator<Asset>> &assets)
+  {
+    uint64_t position = sizeof(PackHeader);
+
+    Asset asset(assets.get_allocator());
+
+    asset.filehandle = handle;
+
+    while (true)
+    {
+      PackChunk chunk;
+
+      platform.read_handle(handle, position, &chunk, sizeof(chunk));
+
+      if (chunk.type == 0x444e4548) // HEND
+        break;
+
+      switch (chunk.type)
+      {
+        case 0x54455341: // ASET
+          {
+            PackAssetHeader aset;
+
+            platform.read_handle(handle, position + sizeof(chunk), &aset, sizeof(aset));
+
+            asset.type = static_cast<AssetType>(aset.type);
+
+            asset.tags = {};
+
+            break;
+          }
+
+        case 0x47415441: // ATAG
+          {
+            PackAssetTag atag;
+
+            platform.read_handle(handle, position + sizeof(chunk), &atag, sizeof(atag));
+
+            asset.tags.push_back({ static_cast<AssetTagId>(atag.id), atag.value });
+
+            break;
+          }
+
+        case 0x52444849: // IHDR
+          {
+            PackImageHeader ihdr = {};
+
+            platform.read_handle(handle, position + sizeof(chunk), &ihdr, min<size_t>(chunk.length, sizeof(ihdr)));
+
+            read_image_header(asset, ihdr);
+
+            break;
+          }
+
+        case 0x52444846: // FHDR
+          {
+            PackFontHeader fhdr = {};
+
+            platform.read_handle(handle, position + sizeof(chunk), &fhdr, min<size_t>(chunk.length, sizeof(fhdr)));
+
+            read_font_header(asset, fhdr);
+
+            break;
+          }
+
+        case 0x444e4541: // AEND
+          {
+            // headers from older builds lack the data chunk checksum
+
+            if (asset.checksum == 0)
+              platform.read_handle(handle, asset.datapos + sizeof(PackChunk) + asset.packedsize, &asset.checksum, sizeof(asset.checksum));
+
+            assets.push_back(asset);
+
+            break;
+          }
+      }
+
+      position += chunk.length + sizeof(chunk) + sizeof(uint32_t);
+    }
+  }
+
+
+  const char *AssetCachePath = "assets.cache";
+
+#pragma pack(push, 1)
+
+  struct AssetCacheHeader
+  {
+    uint8_t signature[8];
+    uint32_t version;
+    uint32_t packcount;
+    uint32_t assetcount;
+    uint32_t tagcount;
+    // AssetCachePack packs[packcount];
+    // AssetCacheEntry entries[assetcount];
+    // PackAssetTag tags[tagcount];
+  };
+
+  struct AssetCachePack
+  {
+    uint64_t size;
+    uint64_t modified;
+    uint32_t hash;
+  };
+
+  struct AssetCacheEntry
+  {
+    uint32_t pack;
+    uint32_t type;
+    uint32_t tagindex;
+    uint32_t tagcount;
+    uint64_t datapos;
+    uint64_t datasize;
+    uint32_t codec;
+    uint64_t packedsize;
+    uint64_t datahash;
+    uint32_t checksum;
+    uint32_t level;
+    uint32_t header;
+    uint32_t info[7]; // image/audio/font info union
+  };
+
+  static_assert(sizeof(AssetInfo) == sizeof(AssetCacheEntry::info), "asset info must match the cache entry");
+
+#pragma pack(pop)
+
+  const AssetCacheHeader AssetCacheSignature = { { 0xCA, 'H', 'H', 'C', 0x0D, 0x0A, 0x1A, 0x0A }, 7 };
+
+
+  ///////////////////////// read_cache_key ////////////////////////////////////
+  AssetCachePack read_cache_key(HandmadePlatform::PlatformInterface &platform, HandmadePlatform::PlatformInterface::handle_t handle)
+  {
+    AssetCachePack key = {};
+
+    platform.stat_handle(handle, &key.size, &key.modified);
+
+    // content hash is the checksum of the toc chunk, packs without a toc are keyed by size and time only
+
+    PackChunk chunk;
+
+    platform.read_handle(handle, sizeof(PackHeader), &chunk, sizeof(chunk));
+
+    if (chunk.type == 0x434f5441) // ATOC
+    {
+      platform.read_handle(handle, sizeof(PackHeader) + sizeof(chunk) + chunk.length, &key.hash, sizeof(key.hash));
+    }
+
+    return key;
+  }
+
+
+  ///////////////////////// read_asset_cache //////////////////////////////////
+  bool read_asset_cache(HandmadePlatform::PlatformInterface &platform, AssetCachePack const *keys, HandmadePlatform::PlatformInterface::handle_t const *handles, size_t count, std::vector<Asset, StackAllocator<Asset>> &assets)
+  {
+    auto handle = platform.open_handle(AssetCachePath, HandmadePlatform::PlatformInterface::OpenMode::Read);
+
+    if (!handle)
+      return false;
+
+    bool result = false;
+
+    try
+    {
+      uint64_t size, modified;
+
+      platform.stat_handle(handle, &size, &modified);
+
+      std::vector<char, StackAllocator<char>> buffer(size, assets.get_allocator());
+
+      platform.read_handle(handle, 0, buffer.data(), buffer.size());
+
+      auto header = reinterpret_cast<AssetCacheHeader const *>(buffer.data());
+
+      if (size < sizeof(AssetCacheHeader) || memcmp(header, &AssetCacheSignature, sizeof(header->signature) + sizeof(header->version)) != 0)
+        throw runtime_error("Invalid asset cache");
+
+      if (size != sizeof(AssetCacheHeader) + header->packcount * sizeof(AssetCachePack) + header->assetcount * sizeof(AssetCacheEntry) + header->tagcount * sizeof(PackAssetTag))
+        throw runtime_error("Invalid asset cache");
+
+      auto packs = reinterpret_cast<AssetCachePack const *>(buffer.data() + sizeof(AssetCacheHeader));
+      auto entries = reinterpret_cast<AssetCacheEntry const *>(packs + header->packcount);
+      auto tags = reinterpret_cast<PackAssetTag const *>(entries + header->assetcount);
+
+      if (header->packcount == count && equal(keys, keys + count, packs, [](auto &lhs, auto &rhs) { return lhs.size == rhs.size && lhs.modified == rhs.modified && lhs.hash == rhs.hash; }))
+      {
+        Asset asset(assets.get_allocator());
+
+        assets.reserve(assets.size() + header->assetcount);
+
+        for(size_t i = 0; i < header->assetcount; ++i)
+        {
+          auto &entry = entries[i];
+
+          if (entry.pack >= count || entry.tagindex + entry.tagcount > header->tagcount)
+            throw runtime_error("Invalid asset cache");
+
+          asset.type = static_cast<AssetType>(entry.type);
+          asset.filehandle = handles[entry.pack];
+          asset.datapos = entry.datapos;
+          asset.datasize = entry.datasize;
+          asset.codec = entry.codec;
+          asset.packedsize = entry.packedsize;
+          asset.datahash = entry.datahash;
+          asset.checksum = entry.checksum;
+          asset.level = entry.level;
+          asset.header = entry.header;
+
+          memcpy(&asset.info, entry.info, sizeof(entry.info));
+
+          asset.tags = {};
+
+          for(size_t k = entry.tagindex; k < entry.tagindex + entry.tagcount; ++k)
+          {
+            asset.tags.push_back({ static_cast<AssetTagId>(tags[k].id), tags[k].value });
+          }
+
+          assets.push_back(asset);
+        }
+
+        result = true;
+      }
+    }
+    catch(std::exception &e)
+    {
+      assets.clear();
+
+      cerr << "Error on asset cache : " << e.what() << endl;
+    }
+
+    platform.close_handle(handle);
+
+    return result;
+  }
+
+
+  ///////////////////////// write_asset_cache /////////////////////////////////
+  void write_asset_cache(HandmadePlatform::PlatformInterface &platform, AssetCachePack const *keys, HandmadePlatform::PlatformInterface::handle_t const *handles, size_t count, std::vector<Asset, StackAllocator<Asset>> const &assets)
+  {
+    size_t tagcount = 0;
+
+    for(auto &asset : assets)
+      tagcount += asset.tags.size();
+
+    AssetCacheHeader header = AssetCacheSignature;
+
+    header.packcount = count;
+    header.assetcount = assets.size();
+    header.tagcount = tagcount;
+
+    std::vector<char, StackAllocator<char>> buffer(sizeof(header) + count * sizeof(AssetCachePack) + assets.size() * sizeof(AssetCacheEntry) + tagcount * sizeof(PackAssetTag), assets.get_allocator());
+
+    memcpy(buffer.data(), &header, sizeof(header));
+
+    auto packs = reinterpret_cast<AssetCachePack*>(buffer.data() + sizeof(header));
+    auto entries = reinterpret_cast<AssetCacheEntry*>(packs + count);
+    auto tags = reinterpret_cast<PackAssetTag*>(entries + assets.size());
+
+    copy(keys, keys + count, packs);
+
+    size_t tagindex = 0;
+
+    for(size_t i = 0; i < assets.size(); ++i)
+    {
+      auto &asset = assets[i];
+
+      auto &entry = entries[i];
+
+      entry.pack = find(handles, handles + count, asset.filehandle) - handles;
+      entry.type = static_cast<uint32_t>(asset.type);
+      entry.tagindex = tagindex;
+      entry.tagcount = asset.tags.size();
+      entry.datapos = asset.datapos;
+      entry.datasize = asset.datasize;
+      entry.codec = asset.codec;
+      entry.packedsize = asset.packedsize;
+      entry.datahash = asset.datahash;
+      entry.checksum = asset.checksum;
+      entry.level = asset.level;
+      entry.header = asset.header;
+
+      memcpy(entry.info, &asset.info, sizeof(entry.info));
+
+      for(auto &tag : asset.tags)
+      {
+        tags[tagindex++] = { static_cast<uint32_t>(tag.id), tag.value };
+      }
+    }
+
+    auto handle = platform.open_handle(AssetCachePath, HandmadePlatform::PlatformInterface::OpenMode::Write);
+
+    if (!handle)
+      return;
+
+    try
+    {
+      platform.write_handle(handle, 0, buffer.data(), buffer.size());
+    }
+    catch(std::exception &e)
+    {
+      cerr << "Error on asset cache : " << e.what() << endl;
+    }
+
+    platform.close_handle(handle);
+  }
+
+
+  struct PackLoader
+  {
+    std::mutex mutex;
+    std::condition_variable signal;
+
+    std::size_t remaining;
+  };
+
+  struct PackLoad
+  {
+    PackLoad(HandmadePlatform::PlatformInterface::handle_t handle, HandmadePlatform::GameMemory const &arena)
+      : handle(handle), arena(arena), assets(this->arena), overflow(false)
+    {
+    }
+
+    HandmadePlatform::PlatformInterface::handle_t handle;
+
+    HandmadePlatform::GameMemory arena;
+
+    std::vector<Asset, StackAllocator<Asset>> assets;
+
+    bool overflow; // ran out of arena, parse again on its own
+  };
+
+
+  ///////////////////////// pack_loader ///////////////////////////////////////
+  void pack_loader(HandmadePlatform::PlatformInterface &platform, void *ldata, void *rdata)
+  {
+    auto &loader = *static_cast<PackLoader*>(ldata);
+
+    auto &pack = *static_cast<PackLoad*>(rdata);
+
+    try
+    {
+      PackHeader header;
+
+      platform.read_handle(pack.handle, 0, &header, sizeof(header));
+
+      if (header.signature[0] != 0xCA || header.signature[1] != 'H' || header.signature[2] != 'H' || header.signature[3] != 'A')
+        throw runtime_error("Invalid hha file");
+
+      if (!read_asset_toc(platform, pack.handle, pack.assets))
+        read_asset_chunks(platform, pack.handle, pack.assets);
+    }
+    catch(std::bad_alloc &e)
+    {
+      pack.assets.clear();
+
+      pack.overflow = true;
+    }
+    catch(std::exception &e)
+    {
+      pack.assets.clear();
+
+      cerr << "Error on asset file : " << e.what() << endl;
+    }
+
+    {
+      lock_guard<mutex> lock(loader.mutex);
+
+      loader.remaining -= 1;
+
+      loader.signal.notify_all();
+    }
+  }
+
+
+  ///////////////////////// floor_log2 ////////////////////////////////////////
+  int floor_log2(uint64_t value)
+  {
+    return 63 - __builtin_clzll(value);
+  }
+
+
+  ///////////////////////// lowest_bit ////////////////////////////////////////
+  int lowest_bit(uint64_t value)
+  {
+    return __builtin_ctzll(value);
+  }
+
+
+  ///////////////////////// bin_index /////////////////////////////////////////
+  void bin_index(size_t size, int splitbits, int &level, int &split)
+  {
+    level = floor_log2(size);
+    split = (size >> (level - splitbits)) & ((1 << splitbits) - 1);
+  }
+
+
+  ///////////////////////// heap_before ///////////////////////////////////////
+  template<typename Slot>
+  bool heap_before(Slot const *lhs, Slot const *rhs)
+  {
+    return lhs->priority < rhs->priority || (lhs->priority == rhs->priority && lhs->stamp < rhs->stamp);
+  }
+
+
+  ///////////////////////// tag_match_factor //////////////////////////////////
+  float tag_match_factor(float value, float target)
+  {
+    return 1/(abs(value - target) + 1e-6f);
+  }
+
 
   ///////////////////////// asset_match_factor ////////////////////////////////
-  float asset_match_factor(Asset const &asset, AssetTag const *tags, float const *weights, size_t n)
+  float asset_match_factor(AssetTag const *assettags, size_t assettagcount, AssetTag const *tags, float const *weights, size_t n)
   {
     float result = 0.0;
 
-    for(size_t i = 0; i < n; ++i)
+    for(size_t i = 0; i < n; ++i)
+    {
+      float factor = 0.0;
+
+      for(size_t k = 0; k < assettagcount; ++k)
+      {
+        if (assettags[k].id == tags[i].id)
+        {
+          factor = max(factor, tag_match_factor(assettags[k].value, tags[i].value));
+        }
+      }
+
+      result += weights[i] * factor;
+    }
+
+    return result;
+  }
+
+
+  // Match factors of a block of eight assets, from tag columns holding one
+  // value per asset (NaN where the asset lacks the tag). Every variant rounds
+  // exactly as asset_match_factor does, so scores compare equal across paths.
+
+  typedef void (*match_factors_t)(AssetTagId const *ids, uint32_t const *offsets, size_t columns, float const *values, AssetTag const *tags, float const *weights, size_t n, float *result);
+
+  ///////////////////////// match_factors_scalar //////////////////////////////
+  void match_factors_scalar(AssetTagId const *ids, uint32_t const *offsets, size_t columns, float const *values, AssetTag const *tags, float const *weights, size_t n, float *result)
+  {
+    for(size_t lane = 0; lane < 8; ++lane)
+    {
+      float total = 0.0;
+
+      for(size_t i = 0; i < n; ++i)
+      {
+        float factor = 0.0;
+
+        for(size_t c = 0; c < columns; ++c)
+        {
+          if (ids[c] == tags[i].id)
+          {
+            factor = max(factor, tag_match_factor(values[offsets[c] + lane], tags[i].value));
+          }
+        }
+
+        total += weights[i] * factor;
+      }
+
+      result[lane] = total;
+    }
+  }
+
+
+#ifdef HAVE_SIMD_MATCH
+
+  ///////////////////////// match_factors_sse /////////////////////////////////
+  __attribute__((target("sse2")))
+  void match_factors_sse(AssetTagId const *ids, uint32_t const *offsets, size_t columns, float const *values, AssetTag const *tags, float const *weights, size_t n, float *result)
+  {
+    for(size_t lane = 0; lane < 8; lane += 4)
+    {
+      __m128 total = _mm_setzero_ps();
+
+      for(size_t i = 0; i < n; ++i)
+      {
+        __m128 factor = _mm_setzero_ps();
+
+        __m128 target = _mm_set1_ps(tags[i].value);
+
+        for(size_t c = 0; c < columns; ++c)
+        {
+          if (ids[c] == tags[i].id)
+          {
+            __m128 distance = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_loadu_ps(values + offsets[c] + lane), target));
+
+            // maxps returns its second operand when the first is NaN, as max(factor, NaN) does
+            factor = _mm_max_ps(_mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(distance, _mm_set1_ps(1e-6f))), factor);
+          }
+        }
+
+        total = _mm_add_ps(total, _mm_mul_ps(_mm_set1_ps(weights[i]), factor));
+      }
+
+      _mm_storeu_ps(result + lane, total);
+    }
+  }
+
+
+  ///////////////////////// match_factors_avx /////////////////////////////////
+  __attribute__((target("avx")))
+  void match_factors_avx(AssetTagId const *ids, uint32_t const *offsets, size_t columns, float const *values, AssetTag const *tags, float const *weights, size_t n, float *result)
+  {
+    __m256 total = _mm256_setzero_ps();
+
+    for(size_t i = 0; i < n; ++i)
+    {
+      __m256 factor = _mm256_setzero_ps();
+
+      __m256 target = _mm256_set1_ps(tags[i].value);
+
+      for(size_t c = 0; c < columns; ++c)
+      {
+        if (ids[c] == tags[i].id)
+        {
+          __m256 distance = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(_mm256_loadu_ps(values + offsets[c]), target));
+
+          factor = _mm256_max_ps(_mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(distance, _mm256_set1_ps(1e-6f))), factor);
+        }
+      }
+
+      total = _mm256_add_ps(total, _mm256_mul_ps(_mm256_set1_ps(weights[i]), factor));
+    }
+
+    _mm256_storeu_ps(result, total);
+  }
+
+#endif
+
+
+  ///////////////////////// select_match_factors //////////////////////////////
+  match_factors_t select_match_factors()
+  {
+#ifdef HAVE_SIMD_MATCH
+    if (__builtin_cpu_supports("avx"))
+      return match_factors_avx;
+
+    if (__builtin_cpu_supports("sse2"))
+      return match_factors_sse;
+#endif
+
+    return match_factors_scalar;
+  }
+}
+
+
+//|---------------------- Asset ---------------------------------------------
+//|--------------------------------------------------------------------------
+
+///////////////////////// Asset::Constructor ////////////////////////////////
+Asset::Asset(allocator_type const &allocator)
+  : tags(allocator)
+{
+}
+
+Asset::Asset(Asset const &other, allocator_type const &allocator)
+  : tags(allocator)
+{
+  *this = other;
+}
+
+
+
+//|---------------------- AssetFont -----------------------------------------
+//|--------------------------------------------------------------------------
+
+///////////////////////// AssetFont::glyph //////////////////////////////////
+PackGlyph const *AssetFont::glyph(uint32_t codepoint) const
+{
+  if (codepoint < DirectLimit)
+    return (direct[codepoint] != 0) ? glyphs + direct[codepoint] - 1 : nullptr;
+
+  auto glyph = lower_bound(glyphs, glyphs + glyphcount, codepoint, [](PackGlyph const &lhs, uint32_t rhs) { return lhs.codepoint < rhs; });
+
+  if (glyph == glyphs + glyphcount || glyph->codepoint != codepoint)
+    return nullptr;
+
+  return glyph;
+}
+
+
+///////////////////////// AssetFont::kern ///////////////////////////////////
+int AssetFont::kern(PackGlyph const *first, PackGlyph const *second) const
+{
+  // pairs of a glyph sort first in its range, ahead of pairs led by codepoints without a glyph
+
+  auto begin = kerning + kernings[first - glyphs];
+  auto end = kerning + kernings[first - glyphs + 1];
+
+  auto kern = lower_bound(begin, end, second->codepoint, [&](PackKerning const &lhs, uint32_t rhs) { return lhs.first < first->codepoint || (lhs.first == first->codepoint && lhs.second < rhs); });
+
+  if (kern == end || kern->first != first->codepoint || kern->second != second->codepoint)
+    return 0;
+
+  return kern->advance;
+}
+
+
+//|---------------------- AssetManager --------------------------------------
+//|--------------------------------------------------------------------------
+
+// best matches of a lookup in catalogue order, the random pick is made per call
+struct AssetManager::Matches
+{
+  enum class Layout
+  {
+    Listed,   // ties holds the matches
+    Run,      // matches are consecutive from ties[0]
+    Unlisted, // too many to keep, found again by rescanning
+  };
+
+  Layout layout;
+
+  uint32_t count;
+
+  float factor;
+
+  AssetId ties[MatchTieLimit];
+};
+
+struct AssetManager::Memo
+{
+  struct Key
+  {
+    AssetType type;
+    uint32_t n;
+    AssetTag tags[MatchTagLimit];
+    float weights[MatchTagLimit];
+  };
+
+  bool used;
+
+  Key key;
+
+  Matches matches;
+};
+
+
+///////////////////////// AssetManager::Constructor /////////////////////////
+AssetManager::AssetManager(allocator_type const &allocator)
+  : m_allocator(allocator),
+    m_types(allocator),
+    m_tagranges(allocator),
+    m_infos(allocator),
+    m_payloads(allocator),
+    m_tags(allocator),
+    m_canonical(allocator),
+    m_mips(allocator),
+    m_slots(allocator),
+    m_traced(allocator),
+    m_tagindex(allocator),
+    m_columntypes(allocator),
+    m_columnids(allocator),
+    m_columnoffsets(allocator),
+    m_columnvalues(allocator),
+    m_heap(allocator),
+    m_evicted(allocator)
+{
+  m_basecount = 0;
+
+  m_slab = nullptr;
+  m_slabend = nullptr;
+
+  m_head = nullptr;
+  m_barriers = nullptr;
+
+  m_binmap = 0;
+  fill_n(m_splitmap, BinLevels, 0);
+  fill_n(&m_bins[0][0], BinLevels * BinSplits, nullptr);
+
+  m_freebytes = 0;
+  m_fragmented = false;
+
+  m_policy = EvictionPolicy::LRU;
+  m_stamp = 0;
+  m_inflation = 0;
+  m_hand = nullptr;
+
+  fill_n(m_stats, 4, AssetStats{});
+
+  m_pending = nullptr;
+  m_pendingcount = 0;
+  m_pendingcapacity = 0;
+
+  m_reads = nullptr;
+
+  m_memosize = 0;
+  m_memo = nullptr;
+
+  m_verify = false;
+
+  m_frame = 0;
+  m_trace = nullptr;
+  m_tracecount = 0;
+  m_tracebuffer = nullptr;
+}
+
+
+///////////////////////// AssetManager::initialise //////////////////////////
+void AssetManager::initialise(std::vector<Asset, StackAllocator<Asset>> const &assets, std::size_t slabsize)
+{
+  m_slab = allocate<char, alignof(Slot)>(m_allocator, slabsize);
+  m_slabend = m_slab + (slabsize & -alignof(Slot));
+
+  auto slab = new(m_slab) Slot;
+
+  slab->size = m_slabend - m_slab;
+  slab->before = nullptr;
+  slab->state = Slot::State::Empty;
+
+  bin_insert(slab);
+
+  // mip levels follow their base image in the packs, collect them per base
+
+  struct Base
+  {
+    Asset const *asset;
+
+    size_t firstmip;
+    size_t mipcount;
+  };
+
+  std::vector<Base, StackAllocator<Base>> bases(m_allocator);
+  std::vector<Asset const *, StackAllocator<Asset const *>> mips(m_allocator);
+
+  auto basecount = count_if(assets.begin(), assets.end(), [](Asset const &asset) { return asset.level == 0; });
+
+  bases.reserve(basecount);
+  mips.reserve(assets.size() - basecount);
+
+  for(auto &asset : assets)
+  {
+    if (asset.level == 0)
+    {
+      bases.push_back({ &asset, mips.size(), 0 });
+
+      continue;
+    }
+
+    auto base = bases.empty() ? nullptr : &bases.back();
+
+    if (!base || base->asset->type != asset.type || base->asset->filehandle != asset.filehandle || base->mipcount + 1 != (size_t)asset.level)
+    {
+      cerr << "Asset Error: Orphaned mip level" << endl;
+
+      continue;
+    }
+
+    mips.push_back(&asset);
+
+    base->mipcount += 1;
+  }
+
+  // group the base assets by type, keeping pack order within a type
+
+  stable_sort(bases.begin(), bases.end(), [](Base const &lhs, Base const &rhs) { return lhs.asset->type < rhs.asset->type; });
+
+  size_t count = bases.size() + mips.size();
+
+  size_t tagcount = 0;
+
+  for(auto &base : bases)
+    tagcount += base.asset->tags.size();
+
+  m_basecount = bases.size();
+
+  m_types.reserve(count);
+  m_tagranges.reserve(count);
+  m_infos.reserve(count);
+  m_payloads.reserve(count);
+  m_tags.reserve(tagcount);
+  m_mips.reserve(count);
+
+  auto push = [&](Asset const &asset, AssetId firstmip, int levels) {
+
+    m_types.push_back(asset.type);
+
+    m_tagranges.push_back({ (uint32_t)m_tags.size(), (uint32_t)asset.tags.size() });
+
+    m_tags.insert(m_tags.end(), asset.tags.begin(), asset.tags.end());
+
+    m_infos.push_back(asset.info);
+
+    if (firstmip != 0)
+      m_infos.back().levels = levels;
+
+    // fonts reserve room for their decoded form, bounded by the glyphs the payload can hold
+
+    uint32_t decodedsize = 0;
+
+    if (asset.header == 0x52444846) // FHDR
+      decodedsize = sizeof(AssetFont) + (asset.datasize / sizeof(PackGlyph) + 1) * sizeof(uint32_t);
+
+    m_payloads.push_back({ asset.filehandle, asset.datapos, (uint32_t)asset.datasize, (uint32_t)asset.packedsize, asset.codec, decodedsize, asset.checksum, false });
+
+    m_mips.push_back(firstmip);
+  };
+
+  AssetId nextmip = m_basecount + 1;
+
+  for(auto &base : bases)
+  {
+    push(*base.asset, (base.mipcount != 0) ? nextmip : 0, 1 + base.mipcount);
+
+    nextmip += base.mipcount;
+  }
+
+  for(auto &base : bases)
+  {
+    for(size_t i = 0; i < base.mipcount; ++i)
+      push(*mips[base.firstmip + i], 0, 1);
+  }
+
+  m_slots.assign(count, nullptr);
+  m_evicted.assign(count, 0);
+  m_traced.assign(count, 0);
+  m_canonical.resize(count);
+
+  m_heap.clear();
+  m_heap.reserve(count);
+
+  for(size_t i = 0; i < count; ++i)
+    m_canonical[i] = i + 1;
+
+  // tag values of each type, ordered for a binary search by value
+
+  m_tagindex.reserve(tagcount);
+
+  for(AssetId id = 1; id <= m_basecount; ++id)
+  {
+    auto &range = m_tagranges[id - 1];
+
+    for(auto tag = m_tags.data() + range.first; tag != m_tags.data() + range.first + range.count; ++tag)
+    {
+      // non finite values never match, leave them out of the index
+
+      if (isfinite(tag->value))
+        m_tagindex.push_back({ m_types[id - 1], tag->id, tag->value, id });
+    }
+  }
+
+  sort(m_tagindex.begin(), m_tagindex.end(), [](TagEntry const &lhs, TagEntry const &rhs) { return tie(lhs.type, lhs.id, lhs.value) < tie(rhs.type, rhs.id, rhs.value); });
+
+  // tag columns, one per tag id and repeat of that id within an asset. Each
+  // is backed by at least one tag, so tagcount bounds them, and they are all
+  // found before the column arrays are sized exactly.
+
+  struct Column
+  {
+    AssetId first;
+    AssetId last;
+
+    AssetTagId id;
+    uint32_t repeat;
+  };
+
+  std::vector<Column, StackAllocator<Column>> columns(m_allocator);
+
+  columns.reserve(tagcount);
+
+  size_t valuecount = 0;
+
+  for(AssetId first = 1, last = 1; first <= m_basecount; first = last)
+  {
+    while (last <= m_basecount && m_types[last - 1] == m_types[first - 1])
+      ++last;
+
+    auto group = columns.size();
+
+    for(AssetId id = first; id != last; ++id)
+    {
+      auto tags = m_tags.data() + m_tagranges[id - 1].first;
+
+      for(size_t k = 0; k < m_tagranges[id - 1].count; ++k)
+      {
+        uint32_t repeat = count_if(tags, tags + k, [&](AssetTag const &tag) { return tag.id == tags[k].id; });
+
+        if (none_of(columns.begin() + group, columns.end(), [&](Column const &column) { return column.id == tags[k].id && column.repeat == repeat; }))
+          columns.push_back({ first, last, tags[k].id, repeat });
+      }
+    }
+
+    valuecount += (columns.size() - group) * ((last - first + 7) & -8);
+  }
+
+  m_columntypes.reserve(columns.size());
+  m_columnids.reserve(columns.size());
+  m_columnoffsets.reserve(columns.size());
+  m_columnvalues.reserve(valuecount);
+
+  for(auto &column : columns)
+  {
+    m_columntypes.push_back(m_types[column.first - 1]);
+    m_columnids.push_back(column.id);
+    m_columnoffsets.push_back(m_columnvalues.size());
+
+    m_columnvalues.resize(m_columnvalues.size() + ((column.last - column.first + 7) & -8), numeric_limits<float>::quiet_NaN());
+
+    for(AssetId id = column.first; id != column.last; ++id)
+    {
+      auto tags = m_tags.data() + m_tagranges[id - 1].first;
+
+      for(size_t k = 0, repeat = 0; k < m_tagranges[id - 1].count; ++k)
+      {
+        if (tags[k].id == column.id && repeat++ == column.repeat)
+          m_columnvalues[m_columnoffsets.back() + (id - column.first)] = tags[k].value;
+      }
+    }
+  }
+
+  // link assets with identical payloads (possibly from different packs) to one canonical asset
+
+  struct Hashed
+  {
+    uint64_t datahash;
+    uint32_t format;
+
+    AssetId asset;
+  };
+
+  std::vector<Hashed, StackAllocator<Hashed>> hashed(m_allocator);
+
+  hashed.reserve(count);
+
+  auto format = [](Asset const *asset) { return (asset->header == 0x52444849) ? uint32_t(asset->info.format) : 0; };
+
+  for(size_t i = 0; i < bases.size(); ++i)
+  {
+    if (bases[i].asset->datahash != 0)
+      hashed.push_back({ bases[i].asset->datahash, format(bases[i].asset), AssetId(i + 1) });
+
+    for(size_t k = 0; k < bases[i].mipcount; ++k)
+    {
+      if (mips[bases[i].firstmip + k]->datahash != 0)
+        hashed.push_back({ mips[bases[i].firstmip + k]->datahash, format(mips[bases[i].firstmip + k]), m_mips[i] + AssetId(k) });
+    }
+  }
+
+  // linked assets load through the canonical's read and decode, so only
+  // payloads stored the same way, with the same checksum, are linked,
+  // sorted next to each other
+
+  auto stored = [&](Hashed const &entry) { auto &payload = m_payloads[entry.asset - 1]; return make_tuple(entry.datahash, entry.format, payload.checksum, payload.datasize, payload.codec, payload.packedsize); };
+
+  sort(hashed.begin(), hashed.end(), [&](Hashed const &lhs, Hashed const &rhs) { return tuple_cat(stored(lhs), tie(lhs.asset)) < tuple_cat(stored(rhs), tie(rhs.asset)); });
+
+  size_t shared = 0;
+
+  for(size_t i = 1; i < hashed.size(); ++i)
+  {
+    auto canonical = m_canonical[hashed[i-1].asset - 1];
+
+    if (stored(hashed[i]) == stored(hashed[i-1]))
+    {
+      m_canonical[hashed[i].asset - 1] = canonical;
+
+      shared += 1;
+    }
+  }
+
+  m_pendingcount = 0;
+  m_pendingcapacity = max(count, size_t(1));
+  m_pending = allocate<Slot*>(m_allocator, m_pendingcapacity);
+  m_reads = allocate<Read>(m_allocator, m_pendingcapacity);
+
+  // lookups memoised against the previous catalogue no longer hold
+
+  m_memosize = MemoSize;
+  m_memo = allocate<Memo>(m_allocator, m_memosize);
+
+  fill_n(m_memo, m_memosize, Memo{});
+
+  cout << "Initialised " << m_basecount << " assets (" << mips.size() << " mip levels, " << shared << " shared payloads)" << endl;
+}
+
+
+///////////////////////// AssetManager::find ////////////////////////////////
+AssetId AssetManager::find(AssetType type) const
+{
+  auto it = lower_bound(m_types.data(), m_types.data() + m_basecount, type);
+
+  if (it == m_types.data() + m_basecount || *it != type)
+    return 0;
+
+  return it - m_types.data() + 1;
+}
+
+
+///////////////////////// AssetManager::find ////////////////////////////////
+AssetId AssetManager::find(random_type &random, AssetType type, AssetTag const *tags, float const *weights, std::size_t n) const
+{
+  Matches local;
+
+  Matches *matches = &local;
+
+  if (n <= MatchTagLimit && m_memo)
+  {
+    Memo::Key key = {};
+
+    key.type = type;
+    key.n = n;
+    copy_n(tags, n, key.tags);
+    copy_n(weights, n, key.weights);
+
+    auto &memo = m_memo[crc32c(&key, sizeof(key)) & (m_memosize - 1)];
+
+    if (!memo.used || memcmp(&memo.key, &key, sizeof(key)) != 0)
+    {
+      match(type, tags, weights, n, memo.matches);
+
+      memo.used = true;
+      memo.key = key;
+    }
+
+    matches = &memo.matches;
+  }
+  else
+  {
+    match(type, tags, weights, n, local);
+  }
+
+  if (matches->count == 0)
+    return 0;
+
+  uint32_t selected = 1;
+
+  if (matches->count > 1)
+    selected = uniform_int_distribution<int>(1, matches->count)(random);
+
+  switch (matches->layout)
+  {
+    case Matches::Layout::Listed:
+      return matches->ties[selected - 1];
+
+    case Matches::Layout::Run:
+      return matches->ties[0] + selected - 1;
+
+    case Matches::Layout::Unlisted:
+      return nth_match(type, tags, weights, n, matches->factor, selected);
+  }
+
+  return 0;
+}
+
+
+///////////////////////// AssetManager::match ///////////////////////////////
+void AssetManager::match(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, Matches &matches) const
+{
+  // Walks the index outwards from each wanted value, nearest first, and stops
+  // once no unvisited asset can reach the best match. Anything the walk can't
+  // answer exactly (odd weights, many tags, wide ties) takes the linear scan.
+
+  if (n == 0 || n > MatchTagLimit)
+    return match_linear(type, tags, weights, n, matches);
+
+  struct Cursor
+  {
+    TagEntry const *first;
+    TagEntry const *last;
+
+    TagEntry const *lo; // next entry below the wanted value, walking down
+    TagEntry const *hi; // next entry at or above the wanted value, walking up
+  };
+
+  Cursor cursors[MatchTagLimit];
+
+  for(size_t i = 0; i < n; ++i)
+  {
+    if (!(weights[i] > 0.0f && isfinite(weights[i]) && isfinite(tags[i].value)))
+      return match_linear(type, tags, weights, n, matches);
+
+    auto range = equal_range(m_tagindex.data(), m_tagindex.data() + m_tagindex.size(), TagEntry{ type, tags[i].id }, [](TagEntry const &lhs, TagEntry const &rhs) { return tie(lhs.type, lhs.id) < tie(rhs.type, rhs.id); });
+
+    auto mid = lower_bound(range.first, range.second, tags[i].value, [](TagEntry const &entry, float value) { return entry.value < value; });
+
+    cursors[i] = { range.first, range.second, mid, mid };
+  }
+
+  auto ties = matches.ties;
+
+  size_t bestcount = 0;
+  float bestfactor = -1.0;
+
+  while (true)
+  {
+    // the match factor falls off with distance, so the cursor fronts bound every unvisited asset
+
+    float bound = 0.0;
+
+    size_t next = n;
+    float nextfactor = -1.0;
+
+    for(size_t i = 0; i < n; ++i)
+    {
+      auto &cursor = cursors[i];
+
+      float frontier = 0.0;
+
+      if (cursor.lo != cursor.first)
+        frontier = max(frontier, tag_match_factor(cursor.lo[-1].value, tags[i].value));
+
+      if (cursor.hi != cursor.last)
+        frontier = max(frontier, tag_match_factor(cursor.hi->value, tags[i].value));
+
+      bound += weights[i] * frontier;
+
+      if ((cursor.lo != cursor.first || cursor.hi != cursor.last) && weights[i] * frontier > nextfactor)
+      {
+        next = i;
+        nextfactor = weights[i] * frontier;
+      }
+    }
+
+    if (next == n || bound < bestfactor)
+      break;
+
+    auto &cursor = cursors[next];
+
+    TagEntry const *entry;
+
+    if (cursor.hi == cursor.last || (cursor.lo != cursor.first && tag_match_factor(cursor.lo[-1].value, tags[next].value) > tag_match_factor(cursor.hi->value, tags[next].value)))
+      entry = --cursor.lo;
+    else
+      entry = cursor.hi++;
+
+    auto &range = m_tagranges[entry->asset - 1];
+
+    auto matchfactor = asset_match_factor(m_tags.data() + range.first, range.count, tags, weights, n);
+
+    if (matchfactor > bestfactor)
+    {
+      bestcount = 0;
+      bestfactor = matchfactor;
+    }
+
+    if (matchfactor == bestfactor && std::find(ties, ties + bestcount, entry->asset) == ties + bestcount)
+    {
+      if (bestcount == MatchTieLimit)
+        return match_linear(type, tags, weights, n, matches);
+
+      ties[bestcount++] = entry->asset;
+    }
+  }
+
+  // unvisited assets match nothing, so they only drop out behind a positive best
+
+  if (!(bestfactor > 0.0f))
+    return match_linear(type, tags, weights, n, matches);
+
+  // ties break in catalogue order, as the linear scan walks them
+
+  sort(ties, ties + bestcount);
+
+  matches.layout = Matches::Layout::Listed;
+  matches.count = bestcount;
+  matches.factor = bestfactor;
+}
+
+
+///////////////////////// AssetManager::match_linear ////////////////////////
+void AssetManager::match_linear(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, Matches &matches) const
+{
+  static const auto match_factors = select_match_factors();
+
+  auto range = equal_range(m_types.data(), m_types.data() + m_basecount, type);
+
+  AssetId first = range.first - m_types.data() + 1;
+  AssetId last = range.second - m_types.data() + 1;
+
+  auto columns = equal_range(m_columntypes.data(), m_columntypes.data() + m_columntypes.size(), type);
+
+  auto ids = m_columnids.data() + (columns.first - m_columntypes.data());
+  auto offsets = m_columnoffsets.data() + (columns.first - m_columntypes.data());
+
+  // candidates are scored in blocks of eight, the padding lanes past the last are ignored
+
+  alignas(32) float matchfactors[8];
+
+  uint32_t bestcount = 0;
+  float bestfactor = -1.0;
+
+  AssetId lasttie = 0;
+
+  for(AssetId block = first; block < last; block += 8)
+  {
+    match_factors(ids, offsets, columns.second - columns.first, m_columnvalues.data() + (block - first), tags, weights, n, matchfactors);
+
+    for(AssetId id = block; id < last && id < block + 8; ++id)
+    {
+      auto matchfactor = matchfactors[id - block];
+
+      if (matchfactor > bestfactor)
+      {
+        bestcount = 0;
+        bestfactor = matchfactor;
+      }
+
+      if (matchfactor == bestfactor)
+      {
+        if (bestcount < MatchTieLimit)
+          matches.ties[bestcount] = id;
+
+        bestcount += 1;
+
+        lasttie = id;
+      }
+    }
+  }
+
+  matches.layout = Matches::Layout::Listed;
+  matches.count = bestcount;
+  matches.factor = bestfactor;
+
+  if (bestcount > MatchTieLimit)
+    matches.layout = (lasttie - matches.ties[0] + 1 == bestcount) ? Matches::Layout::Run : Matches::Layout::Unlisted;
+}
+
+
+///////////////////////// AssetManager::nth_match ///////////////////////////
+AssetId AssetManager::nth_match(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, float factor, uint32_t selected) const
+{
+  static const auto match_factors = select_match_factors();
+
+  auto range = equal_range(m_types.data(), m_types.data() + m_basecount, type);
+
+  AssetId first = range.first - m_types.data() + 1;
+  AssetId last = range.second - m_types.data() + 1;
+
+  auto columns = equal_range(m_columntypes.data(), m_columntypes.data() + m_columntypes.size(), type);
+
+  auto ids = m_columnids.data() + (columns.first - m_columntypes.data());
+  auto offsets = m_columnoffsets.data() + (columns.first - m_columntypes.data());
+
+  alignas(32) float matchfactors[8];
+
+  for(AssetId block = first; block < last; block += 8)
+  {
+    match_factors(ids, offsets, columns.second - columns.first, m_columnvalues.data() + (block - first), tags, weights, n, matchfactors);
+
+    for(AssetId id = block; id < last && id < block + 8; ++id)
+    {
+      if (matchfactors[id - block] == factor && --selected == 0)
+        return id;
+    }
+  }
+
+  return 0;
+}
+
+
+///////////////////////// AssetManager::aquire_slot /////////////////////////
+AssetManager::Slot *AssetManager::aquire_slot(size_t size)
+{
+  auto bytes = ((size + sizeof(Slot) - 1)/alignof(Slot) + 1) * alignof(Slot);
+
+  auto slot = bin_search(bytes);
+
+  if (!slot && m_freebytes >= bytes)
+    m_fragmented = true;
+
+  while (!slot)
+  {
+    // evict until one fits, never a payload used since the oldest barrier
+
+    auto victim = choose_victim();
+
+    if (!victim)
+      return nullptr;
+
+    m_stats[static_cast<int>(m_policy)].evictions += 1;
+
+    m_evicted[victim->asset - 1] = m_frame + 1;
+
+    if (m_policy == EvictionPolicy::GDSF)
+      m_inflation = max(m_inflation, victim->priority);
+
+    m_slots[victim->asset - 1] = nullptr;
+
+    auto merged = release_slot(victim);
+
+    if (merged->size >= bytes)
+      slot = merged;
+  }
+
+  bin_remove(slot);
+
+  if (slot->size >= bytes + sizeof(Slot))
+  {
+    // split
+
+    auto rest = new(reinterpret_cast<char*>(slot) + bytes) Slot;
+
+    rest->size = slot->size - bytes;
+    rest->before = slot;
+    rest->state = Slot::State::Empty;
+
+    if (reinterpret_cast<char*>(rest) + rest->size != m_slabend)
+      reinterpret_cast<Slot*>(reinterpret_cast<char*>(rest) + rest->size)->before = rest;
+
+    slot->size = bytes;
+
+    bin_insert(rest);
+  }
+
+  slot->hits = 0;
+  slot->referenced = true;
+
+  link_slot(m_head, slot);
+
+  return slot;
+}
+
+
+///////////////////////// AssetManager::touch_slot //////////////////////////
+AssetManager::Slot *AssetManager::touch_slot(AssetManager::Slot *slot)
+{
+  unlink_slot(m_head, slot);
+
+  link_slot(m_head, slot);
+
+  return slot;
+}
+
+
+///////////////////////// AssetManager::link_slot ///////////////////////////
+void AssetManager::link_slot(Slot *&list, Slot *slot)
+{
+  slot->stamp = ++m_stamp;
+
+  if (!list)
+  {
+    slot->prev = slot;
+    slot->next = slot;
+
+    list = slot;
+
+    return;
+  }
+
+  slot->next = list;
+  slot->prev = list->prev;
+
+  slot->prev->next = slot;
+  slot->next->prev = slot;
+}
+
+
+///////////////////////// AssetManager::unlink_slot /////////////////////////
+void AssetManager::unlink_slot(Slot *&list, Slot *slot)
+{
+  if (slot->next == slot)
+  {
+    list = nullptr;
+
+    return;
+  }
+
+  if (slot == list)
+    list = list->next;
+
+  slot->prev->next = slot->next;
+  slot->next->prev = slot->prev;
+}
+
+
+///////////////////////// AssetManager::release_slot ////////////////////////
+AssetManager::Slot *AssetManager::release_slot(Slot *slot)
+{
+  if (slot->state == Slot::State::Loaded)
+    heap_remove(slot);
+
+  unlink_slot((slot->state == Slot::State::Barrier) ? m_barriers : m_head, slot);
+
+  slot->state = Slot::State::Empty;
+
+  auto after = reinterpret_cast<Slot*>(reinterpret_cast<char*>(slot) + slot->size);
+
+  if (reinterpret_cast<char*>(after) != m_slabend && after->state == Slot::State::Empty)
+  {
+    // merge
+
+    bin_remove(after);
+
+    slot->size += after->size;
+
+    if (m_hand == after)
+      m_hand = slot;
+  }
+
+  if (slot->before && slot->before->state == Slot::State::Empty)
+  {
+    // merge
+
+    bin_remove(slot->before);
+
+    slot->before->size += slot->size;
+
+    if (m_hand == slot)
+      m_hand = slot->before;
+
+    slot = slot->before;
+  }
+
+  after = reinterpret_cast<Slot*>(reinterpret_cast<char*>(slot) + slot->size);
+
+  if (reinterpret_cast<char*>(after) != m_slabend)
+    after->before = slot;
+
+  bin_insert(slot);
+
+  return slot;
+}
+
+
+///////////////////////// AssetManager::discard_slot ////////////////////////
+void AssetManager::discard_slot(Slot *slot)
+{
+  // the payload failed its checksum, never hand it out or read it again
+
+  m_payloads[slot->asset - 1].corrupt = true;
+
+  m_stats[static_cast<int>(m_policy)].corrupt += 1;
+
+  m_slots[slot->asset - 1] = nullptr;
+
+  release_slot(slot);
+}
+
+
+///////////////////////// AssetManager::bin_insert //////////////////////////
+void AssetManager::bin_insert(Slot *slot)
+{
+  int level, split;
+  bin_index(slot->size, BinSplitBits, level, split);
+
+  slot->prev = nullptr;
+  slot->next = m_bins[level][split];
+
+  if (slot->next)
+    slot->next->prev = slot;
+
+  m_bins[level][split] = slot;
+
+  m_binmap |= uint64_t(1) << level;
+  m_splitmap[level] |= 1 << split;
+
+  m_freebytes += slot->size;
+}
+
+
+///////////////////////// AssetManager::bin_remove //////////////////////////
+void AssetManager::bin_remove(Slot *slot)
+{
+  int level, split;
+  bin_index(slot->size, BinSplitBits, level, split);
+
+  if (slot->prev)
+    slot->prev->next = slot->next;
+  else
+    m_bins[level][split] = slot->next;
+
+  if (slot->next)
+    slot->next->prev = slot->prev;
+
+  if (!m_bins[level][split])
+  {
+    m_splitmap[level] &= ~(1 << split);
+
+    if (!m_splitmap[level])
+      m_binmap &= ~(uint64_t(1) << level);
+  }
+
+  m_freebytes -= slot->size;
+}
+
+
+///////////////////////// AssetManager::bin_search //////////////////////////
+AssetManager::Slot *AssetManager::bin_search(size_t bytes) const
+{
+  // search from the bin above the size, every slot there is large enough
+
+  int level, split;
+  bin_index(bytes + (size_t(1) << (floor_log2(bytes) - BinSplitBits)) - 1, BinSplitBits, level, split);
+
+  uint32_t splits = m_splitmap[level] & (~0u << split);
+
+  if (!splits)
+  {
+    auto levels = (level + 1 < BinLevels) ? m_binmap & (~uint64_t(0) << (level + 1)) : 0;
+
+    if (!levels)
+      return nullptr;
+
+    level = lowest_bit(levels);
+
+    splits = m_splitmap[level];
+  }
+
+  return m_bins[level][lowest_bit(splits)];
+}
+
+
+///////////////////////// AssetManager::choose_victim ///////////////////////
+AssetManager::Slot *AssetManager::choose_victim()
+{
+  // slots used since the oldest barrier may still be drawn this frame
+
+  auto oldest = m_barriers ? m_barriers->stamp : numeric_limits<uint64_t>::max();
+
+  if (m_heap.empty())
+    return nullptr;
+
+  switch (m_policy)
+  {
+    case EvictionPolicy::LRU:
+
+      for(auto slot = m_head; slot && slot->stamp < oldest; slot = (slot->next != m_head) ? slot->next : nullptr)
+      {
+        if (slot->state == Slot::State::Loaded)
+          return slot;
+      }
+
+      break;
+
+    case EvictionPolicy::CLOCK:
+    {
+      // sweep the slab from the hand, clearing reference bits on the first
+      // pass, a second pass finds any unreferenced slot left
+
+      auto start = m_hand ? reinterpret_cast<char*>(m_hand) : m_slab;
+
+      auto position = start;
+
+      for(int pass = 0; pass < 2; )
+      {
+        auto slot = reinterpret_cast<Slot*>(position);
+
+        position += slot->size;
+
+        if (position == m_slabend)
+          position = m_slab;
+
+        if (slot->state == Slot::State::Loaded && slot->stamp < oldest)
+        {
+          if (!slot->referenced)
+          {
+            m_hand = (position != m_slab) ? reinterpret_cast<Slot*>(position) : nullptr;
+
+            return slot;
+          }
+
+          slot->referenced = false;
+        }
+
+        if (position == start)
+          pass += 1;
+      }
+
+      break;
+    }
+
+    case EvictionPolicy::LFU:
+    case EvictionPolicy::GDSF:
+
+      return heap_victim(0, oldest);
+  }
+
+  return nullptr;
+}
+
+
+///////////////////////// AssetManager::hit_slot ////////////////////////////
+void AssetManager::hit_slot(Slot *slot)
+{
+  slot->hits += 1;
+  slot->referenced = true;
+
+  m_stats[static_cast<int>(m_policy)].hits += 1;
+
+  heap_update(slot);
+}
+
+
+///////////////////////// AssetManager::priority ////////////////////////////
+double AssetManager::priority(Slot const *slot) const
+{
+  switch (m_policy)
+  {
+    case EvictionPolicy::LFU:
+      return slot->hits;
+
+    case EvictionPolicy::GDSF:
+      return m_inflation + (slot->hits + 1) / static_cast<double>(slot->size);
+
+    default:
+      return 0; // recency, ties break on the stamp
+  }
+}
+
+
+///////////////////////// AssetManager::heap_insert /////////////////////////
+void AssetManager::heap_insert(Slot *slot)
+{
+  slot->priority = priority(slot);
+  slot->heapindex = m_heap.size();
+
+  m_heap.push_back(slot);
+
+  heap_up(slot->heapindex);
+}
+
+
+///////////////////////// AssetManager::heap_remove /////////////////////////
+void AssetManager::heap_remove(Slot *slot)
+{
+  auto index = slot->heapindex;
+
+  m_heap[index] = m_heap.back();
+  m_heap[index]->heapindex = index;
+
+  m_heap.pop_back();
+
+  if (index < m_heap.size())
+  {
+    heap_up(index);
+    heap_down(m_heap[index]->heapindex);
+  }
+}
+
+
+///////////////////////// AssetManager::heap_update /////////////////////////
+void AssetManager::heap_update(Slot *slot)
+{
+  slot->priority = priority(slot);
+
+  heap_up(slot->heapindex);
+  heap_down(slot->heapindex);
+}
+
+
+///////////////////////// AssetManager::heap_up /////////////////////////////
+void AssetManager::heap_up(size_t index)
+{
+  auto slot = m_heap[index];
+
+  while (index > 0 && heap_before(slot, m_heap[(index - 1)/2]))
+  {
+    m_heap[index] = m_heap[(index - 1)/2];
+    m_heap[index]->heapindex = index;
+
+    index = (index - 1)/2;
+  }
+
+  m_heap[index] = slot;
+  m_heap[index]->heapindex = index;
+}
+
+
+///////////////////////// AssetManager::heap_down ///////////////////////////
+void AssetManager::heap_down(size_t index)
+{
+  auto slot = m_heap[index];
+
+  while (2*index + 1 < m_heap.size())
+  {
+    auto child = 2*index + 1;
+
+    if (child + 1 < m_heap.size() && heap_before(m_heap[child + 1], m_heap[child]))
+      child += 1;
+
+    if (!heap_before(m_heap[child], slot))
+      break;
+
+    m_heap[index] = m_heap[child];
+    m_heap[index]->heapindex = index;
+
+    index = child;
+  }
+
+  m_heap[index] = slot;
+  m_heap[index]->heapindex = index;
+}
+
+
+///////////////////////// AssetManager::heap_victim /////////////////////////
+AssetManager::Slot *AssetManager::heap_victim(size_t index, uint64_t oldest) const
+{
+  // lowest priority slot not used since the oldest barrier, only protected
+  // slots are looked beneath
+
+  if (index >= m_heap.size())
+    return nullptr;
+
+  if (m_heap[index]->stamp < oldest)
+    return m_heap[index];
+
+  auto lhs = heap_victim(2*index + 1, oldest);
+  auto rhs = heap_victim(2*index + 2, oldest);
+
+  if (!lhs || (rhs && heap_before(rhs, lhs)))
+    return rhs;
+
+  return lhs;
+}
+
+
+///////////////////////// AssetManager::mip /////////////////////////////////
+AssetId AssetManager::mip(AssetId asset, int level) const
+{
+  level = min(level, m_infos[asset - 1].levels - 1);
+
+  if (level <= 0)
+    return asset;
+
+  return m_mips[asset - 1] + level - 1;
+}
+
+
+///////////////////////// AssetManager::request /////////////////////////////
+void const *AssetManager::request(HandmadePlatform::PlatformInterface &platform, AssetId asset)
+{
+  lock_guard<mutex> lock(m_mutex);
+
+  if (m_trace && !m_traced[asset - 1])
+  {
+    m_traced[asset - 1] = true;
+
+    m_tracebuffer[m_tracecount++] = asset;
+  }
+
+  auto canonical = m_canonical[asset - 1];
+
+  auto &slot = m_slots[canonical - 1];
+
+  if (!slot)
+  {
+    auto &payload = m_payloads[canonical - 1];
+
+    if (payload.corrupt)
+      return nullptr;
+
+    auto storage = payload_storage(payload) + (m_verify ? sizeof(uint32_t) : 0);
+
+    if (payload.decodedsize != 0)
+      storage = decoded_position(payload) + payload.decodedsize;
+
+    auto &stats = m_stats[static_cast<int>(m_policy)];
+
+    stats.misses += 1;
+
+    slot = aquire_slot(storage);
+
+    if (!slot)
+      stats.failures += 1;
+
+    if (slot)
+    {
+      if (m_evicted[canonical - 1] != 0)
+      {
+        stats.reloadbytes += payload.packedsize;
+
+        if (m_frame + 1 - m_evicted[canonical - 1] <= AssetStats::RefetchFrames)
+          stats.refetches += 1;
+      }
+
+      slot->state = Slot::State::Loading;
+
+      slot->asset = canonical;
+
+      assert(m_pendingcount < m_pendingcapacity);
+
+      m_pending[m_pendingcount++] = slot;
+    }
+
+    return nullptr;
+  }
+
+  touch_slot(slot);
+
+  if (slot->state != Slot::State::Loaded)
+    return nullptr;
+
+  hit_slot(slot);
+
+  return slot->data;
+}
+
+
+///////////////////////// AssetManager::request /////////////////////////////
+void const *AssetManager::request(HandmadePlatform::PlatformInterface &platform, AssetId asset, int level)
+{
+  return request(platform, mip(asset, level));
+}
+
+
+///////////////////////// AssetManager::resident ////////////////////////////
+void const *AssetManager::resident(AssetId asset)
+{
+  lock_guard<mutex> lock(m_mutex);
+
+  auto slot = m_slots[m_canonical[asset - 1] - 1];
+
+  if (!slot || slot->state != Slot::State::Loaded)
+    return nullptr;
+
+  touch_slot(slot);
+
+  hit_slot(slot);
+
+  return slot->data;
+}
+
+
+///////////////////////// AssetManager::font ////////////////////////////////
+AssetFont const *AssetManager::font(HandmadePlatform::PlatformInterface &platform, AssetId asset)
+{
+  auto &payload = m_payloads[m_canonical[asset - 1] - 1];
+
+  if (payload.decodedsize == 0)
+    return nullptr;
+
+  auto data = static_cast<char const *>(request(platform, asset));
+
+  if (!data)
+    return nullptr;
+
+  return reinterpret_cast<AssetFont const *>(data + decoded_position(payload));
+}
+
+
+///////////////////////// AssetManager::flush ///////////////////////////////
+void AssetManager::flush(HandmadePlatform::PlatformInterface &platform)
+{
+  // reads are gathered under the lock and issued after it, a full io queue
+  // blocks the read and must not hold up the loaders publishing their slots
+
+  size_t readcount = 0;
+
+  unique_lock<mutex> lock(m_mutex);
+
+  if (m_trace)
+  {
+    try
+    {
+      write_trace(platform);
+    }
+    catch(std::exception &e)
+    {
+      cerr << "Error on asset trace : " << e.what() << endl;
+
+      platform.close_handle(m_trace);
+
+      m_trace = nullptr;
+    }
+  }
+
+  m_frame += 1;
+
+  auto extent = [&](Payload const &payload) { return payload.packedsize + (m_verify ? sizeof(uint32_t) : 0); };
+
+  sort(m_pending, m_pending + m_pendingcount, [&](Slot const *lhs, Slot const *rhs) {
+    auto &l = m_payloads[lhs->asset - 1];
+    auto &r = m_payloads[rhs->asset - 1];
+    return less<void*>()(l.filehandle, r.filehandle) || (l.filehandle == r.filehandle && l.datapos < r.datapos);
+  });
+
+  for(size_t i = 0, j = 0; i < m_pendingcount; i = j)
+  {
+    auto &first = m_payloads[m_pending[i]->asset - 1];
+
+    auto begin = payload_position(first);
+    auto end = begin + extent(first);
+
+    for(j = i + 1; j < m_pendingcount; ++j)
+    {
+      auto &payload = m_payloads[m_pending[j]->asset - 1];
+
+      if (payload.filehandle != first.filehandle)
+        break;
+
+      if (payload_position(payload) > end + CoalesceGap || payload_position(payload) + extent(payload) > begin + CoalesceLimit)
+        break;
+
+      end = max(end, payload_position(payload) + extent(payload));
+    }
+
+    if (j - i > 1)
+    {
+      // merge the run into one read, batch_loader scatters it into the slots
+
+      auto header = (sizeof(Batch) + (j - i)*sizeof(Slot*) + alignof(Slot) - 1) & -alignof(Slot);
+
+      auto staging = aquire_slot(header + (end - begin));
+
+      if (staging)
+      {
+        staging->state = Slot::State::Loading;
+        staging->asset = 0;
+
+        auto batch = reinterpret_cast<Batch*>(staging->data);
+
+        batch->position = begin;
+        batch->count = j - i;
+
+        copy(m_pending + i, m_pending + j, batch->slots);
+
+        m_reads[readcount++] = { first.filehandle, begin, staging->data + header, end - begin, batch_loader, staging };
+
+        continue;
+      }
+    }
+
+    for(auto k = i; k < j; ++k)
     {
-      float factor = 0.0;
+      auto slot = m_pending[k];
 
-      for(auto &tag: asset.tags)
-      {
-        if (tag.id == tags[i].id)
-        {
-          factor = max(factor, 1/(abs(tag.value - tags[i].value) + 1e-6f));
-        }
-      }
+      auto &payload = m_payloads[slot->asset - 1];
 
-      result += weights[i] * factor;
-    }
+      auto storage = payload_storage(payload);
 
-    return result;
+      m_reads[readcount++] = { payload.filehandle, payload_position(payload), slot->data + storage - payload.packedsize, extent(payload), background_loader, slot };
+    }
   }
 
-}
+  m_pendingcount = 0;
 
+  lock.unlock();
 
-//|---------------------- Asset ---------------------------------------------
-//|--------------------------------------------------------------------------
+  // the slots stay loading until their loader runs, so nothing moves or evicts them
 
-///////////////////////// Asset::Constructor ////////////////////////////////
-Asset::Asset(allocator_type const &allocator)
-  : tags(allocator)
-{
+  for(size_t i = 0; i < readcount; ++i)
+  {
+    auto &read = m_reads[i];
+
+    platform.read_handle(read.filehandle, read.position, read.buffer, read.size, read.loader, this, read.slot);
+  }
 }
 
-Asset::Asset(Asset const &other, allocator_type const &allocator)
-  : tags(allocator)
+
+///////////////////////// AssetManager::verify_payloads /////////////////////
+void AssetManager::verify_payloads(bool enabled)
 {
-  *this = other;
+  m_verify = enabled;
 }
 
 
-///////////////////////// AssetEx::Constructor //////////////////////////////
-AssetManager::AssetEx::AssetEx(Asset const &asset, allocator_type const &allocator)
-  : Asset(asset, allocator)
+///////////////////////// AssetManager::eviction_policy /////////////////////
+void AssetManager::eviction_policy(EvictionPolicy policy)
 {
-  slot = nullptr;
+  lock_guard<mutex> lock(m_mutex);
+
+  m_policy = policy;
+
+  for(auto &slot : m_heap)
+  {
+    slot->priority = priority(slot);
+  }
+
+  for(size_t index = m_heap.size()/2; index-- > 0; )
+  {
+    heap_down(index);
+  }
 }
 
 
+///////////////////////// AssetManager::stats ///////////////////////////////
+AssetStats AssetManager::stats(EvictionPolicy policy) const
+{
+  lock_guard<mutex> lock(m_mutex);
 
-//|---------------------- AssetManager --------------------------------------
-//|--------------------------------------------------------------------------
+  return m_stats[static_cast<int>(policy)];
+}
 
-///////////////////////// AssetManager::Constructor /////////////////////////
-AssetManager::AssetManager(allocator_type const &allocator)
-  : m_allocator(allocator),
-    m_assets(allocator)
+
+///////////////////////// AssetManager::record_trace ////////////////////////
+void AssetManager::record_trace(HandmadePlatform::PlatformInterface &platform, const char *path)
 {
-  m_head = nullptr;
+  lock_guard<mutex> lock(m_mutex);
+
+  auto handle = platform.open_handle(path, HandmadePlatform::PlatformInterface::OpenMode::Write);
+
+  if (!handle)
+    return;
+
+  PackTraceHeader header = { { 0xCA, 'H', 'H', 'T', 0x0D, 0x0A, 0x1A, 0x0A }, 1 };
+
+  platform.write_handle(handle, 0, &header, sizeof(header));
+
+  // each asset is traced once, so the buffer never holds more than the catalogue
+
+  m_trace = handle;
+  m_traceposition = sizeof(header);
+  m_tracecount = 0;
+  m_tracebuffer = allocate<AssetId>(m_allocator, max(m_types.size(), size_t(1)));
 }
 
 
-///////////////////////// AssetManager::initialise //////////////////////////
-void AssetManager::initialise(std::vector<Asset, StackAllocator<Asset>> const &assets, std::size_t slabsize)
+///////////////////////// AssetManager::write_trace /////////////////////////
+void AssetManager::write_trace(HandmadePlatform::PlatformInterface &platform)
 {
-  m_head = new(allocate<char, alignof(Slot)>(m_allocator, slabsize)) Slot;
+  if (m_tracecount == 0)
+    return;
 
-  m_head->size = slabsize;
-  m_head->after = nullptr;
-  m_head->prev = m_head;
-  m_head->next = m_head;
-  m_head->state = Slot::State::Empty;
+  // payloads are identified by their chunk checksum, which survives rebuilds and
+  // reordering, taken from the catalogue so tracing costs no reads
 
-  for(auto &asset : assets)
+  const size_t BatchSize = 64;
+
+  PackTraceEntry entries[BatchSize];
+
+  for(size_t i = 0; i < m_tracecount; i += BatchSize)
   {
-    m_assets.emplace(asset.type, asset);
+    auto count = min(m_tracecount - i, BatchSize);
+
+    for(size_t k = 0; k < count; ++k)
+    {
+      auto &payload = m_payloads[m_tracebuffer[i + k] - 1];
+
+      entries[k].frame = m_frame;
+      entries[k].packedsize = payload.packedsize;
+      entries[k].checksum = payload.checksum;
+    }
+
+    platform.write_handle(m_trace, m_traceposition, entries, count * sizeof(PackTraceEntry));
+
+    m_traceposition += count * sizeof(PackTraceEntry);
   }
 
-  cout << "Initialised " << m_assets.size() << " assets" << endl;
+  m_tracecount = 0;
 }
 
 
-///////////////////////// AssetManager::find ////////////////////////////////
-Asset const *AssetManager::find(AssetType type) const
+///////////////////////// AssetManager::aquire_barrier //////////////////////
+uintptr_t AssetManager::aquire_barrier()
 {
-  Asset const *result = nullptr;
+  lock_guard<mutex> lock(m_mutex);
 
-  auto it = m_assets.find(type);
+  auto slot = aquire_slot(0);
+
+  if (slot)
+  {
+    unlink_slot(m_head, slot);
 
-  if (it != m_assets.end())
-    result = &it->second;
+    link_slot(m_barriers, slot);
 
-  return result;
+    slot->state = Slot::State::Barrier;
+  }
+
+  return reinterpret_cast<uintptr_t>(slot);
 }
 
 
-///////////////////////// AssetManager::find ////////////////////////////////
-Asset const *AssetManager::find(random_type &random, AssetType type, AssetTag const *tags, float const *weights, std::size_t n) const
+///////////////////////// AssetManager::release_barrier /////////////////////
+void AssetManager::release_barrier(uintptr_t barrier)
 {
-  Asset const *result = nullptr;
-
-  auto range = m_assets.equal_range(type);
+  lock_guard<mutex> lock(m_mutex);
 
-  int bestcount = 0;
-  float bestfactor = -1.0;
+  auto slot = reinterpret_cast<Slot*>(barrier);
 
-  for(auto it = range.first; it != range.second; ++it)
+  if (slot)
   {
-    auto &asset = it->second;
+    release_slot(slot);
+  }
+}
 
-    auto matchfactor = asset_match_factor(asset, tags, weights, n);
 
-    if (matchfactor == bestfactor)
-      ++bestcount;
+///////////////////////// AssetManager::compact /////////////////////////////
+void AssetManager::compact()
+{
+  lock_guard<mutex> lock(m_mutex);
 
-    if (matchfactor > bestfactor)
-    {
-      bestcount = 1;
-      bestfactor = matchfactor;
+  if (!m_fragmented || !m_slab)
+    return;
 
-      result = &asset;
-    }
-  }
+  if (m_barriers)
+    return;
+
+  // Walk the slab bottom up, sliding each loaded slot that follows free space
+  // down over it, so the free space rises towards the top. Slots still
+  // loading are being written to and keep their place. The slab is whole
+  // after every slide, so a call out of budget stops and the next resumes.
 
-  if (bestcount > 1)
+  size_t moved = 0;
+
+  for(auto position = m_slab; position != m_slabend; )
   {
-    auto selected = uniform_int_distribution<int>(1, bestcount)(random);
+    auto slot = reinterpret_cast<Slot*>(position);
+
+    auto after = reinterpret_cast<Slot*>(position + slot->size);
 
-    for(auto it = range.first; selected != 0; --selected, ++it)
+    if (slot->state != Slot::State::Empty || reinterpret_cast<char*>(after) == m_slabend || after->state != Slot::State::Loaded)
     {
-      // TODO: I'm a little worried about the termination condition of this loop, have another look
-      while(asset_match_factor(it->second, tags, weights, n) != bestfactor)
-        ++it;
+      position += slot->size;
 
-      result = &it->second;
+      continue;
     }
-  }
 
-  return result;
-}
+    if (moved >= CompactBudget)
+      return;
 
+    m_hand = nullptr;
 
-///////////////////////// AssetManager::aquire_slot /////////////////////////
-AssetManager::Slot *AssetManager::aquire_slot(size_t size)
-{
-  auto bytes = ((size + sizeof(Slot) - 1)/alignof(Slot) + 1) * alignof(Slot);
+    auto gap = slot->size;
+    auto before = slot->before;
 
-  for(auto slot = m_head; true; slot = slot->next)
-  {
-    if (slot->state == Slot::State::Barrier)
-      return nullptr;
+    bin_remove(slot);
 
-    if (slot->state == Slot::State::Loaded)
+    auto loaded = static_cast<Slot*>(memmove(slot, after, after->size));
+
+    if (loaded->next == after)
+    {
+      loaded->prev = loaded;
+      loaded->next = loaded;
+    }
+    else
     {
-      // evict
+      loaded->prev->next = loaded;
+      loaded->next->prev = loaded;
+    }
 
-      slot->asset->slot = nullptr;
+    if (m_head == after)
+      m_head = loaded;
 
-      slot->state = Slot::State::Empty;
-    }
+    loaded->before = before;
 
-    if (slot->state == Slot::State::Empty)
-    {
-      if (slot->after && slot->after->state == Slot::State::Empty)
-      {
-        // merge
+    m_slots[loaded->asset - 1] = loaded;
 
-        slot->after->prev->next = slot->after->next;
-        slot->after->next->prev = slot->after->prev;
+    m_heap[loaded->heapindex] = loaded;
 
-        slot->size += slot->after->size;
-        slot->after = slot->after->after;
+    // decoded forms point into their payload
 
-        m_head = slot;
-      }
+    auto &payload = m_payloads[loaded->asset - 1];
 
-      if (slot->size > bytes + sizeof(Slot))
-      {
-        // split
+    if (payload.decodedsize != 0)
+      decode_font(payload, loaded->data);
 
-        Slot *newslot = reinterpret_cast<Slot*>(reinterpret_cast<char*>(slot) + bytes);
+    moved += loaded->size;
 
-        newslot->size = slot->size - bytes;
-        newslot->after = slot->after;
-        newslot->prev = m_head->prev;
-        newslot->next = m_head;
-        newslot->state = Slot::State::Empty;
+    // the free space now follows, joined with any beyond it
 
-        newslot->prev->next = newslot;
-        newslot->next->prev = newslot;
+    auto empty = new(position + loaded->size) Slot;
 
-        slot->size = bytes;
-        slot->after = newslot;
+    empty->size = gap;
+    empty->before = loaded;
+    empty->state = Slot::State::Empty;
 
-        m_head = newslot;
-      }
+    auto next = reinterpret_cast<Slot*>(reinterpret_cast<char*>(empty) + empty->size);
 
-      if (slot->size >= bytes)
-      {
-        // match
+    if (reinterpret_cast<char*>(next) != m_slabend && next->state == Slot::State::Empty)
+    {
+      bin_remove(next);
 
-        touch_slot(slot);
+      empty->size += next->size;
 
-        return slot;
-      }
+      next = reinterpret_cast<Slot*>(reinterpret_cast<char*>(empty) + empty->size);
     }
 
-    if (slot->next == m_head)
-      return nullptr;
+    if (reinterpret_cast<char*>(next) != m_slabend)
+      next->before = empty;
+
+    bin_insert(empty);
+
+    position = reinterpret_cast<char*>(empty);
   }
+
+  m_fragmented = false;
 }
 
 
-///////////////////////// AssetManager::touch_slot //////////////////////////
-AssetManager::Slot *AssetManager::touch_slot(AssetManager::Slot *slot)
+///////////////////////// AssetManager::payload_position ////////////////////
+uint64_t AssetManager::payload_position(Payload const &payload)
 {
-  if (slot == m_head)
-    m_head = m_head->next;
+  return payload.datapos + sizeof(PackChunk);
+}
 
-  slot->prev->next = slot->next;
-  slot->next->prev = slot->prev;
 
-  slot->next = m_head;
-  slot->prev = m_head->prev;
+///////////////////////// AssetManager::payload_storage /////////////////////
+size_t AssetManager::payload_storage(Payload const &payload)
+{
+  // compressed payloads are read to the tail of the slot and decompressed in place
 
-  slot->prev->next = slot;
-  slot->next->prev = slot;
+  if (payload.codec == static_cast<uint32_t>(PackCodec::LZ4))
+    return payload.datasize + lz4_inplace_margin(payload.datasize);
 
-  return slot;
+  return payload.datasize;
 }
 
 
-///////////////////////// AssetManager::request /////////////////////////////
-void const *AssetManager::request(HandmadePlatform::PlatformInterface &platform, Asset const *asset)
+///////////////////////// AssetManager::verify_payload //////////////////////
+bool AssetManager::verify_payload(Payload const &payload, void const *src)
 {
-  lock_guard<mutex> lock(m_mutex);
+  // the chunk checksum follows the stored payload
 
-  auto &slot = static_cast<AssetEx*>(const_cast<Asset*>(asset))->slot;
+  uint32_t checksum;
 
-  if (!slot)
-  {
-    slot = aquire_slot(asset->datasize);
+  memcpy(&checksum, static_cast<char const *>(src) + payload.packedsize, sizeof(checksum));
 
-    if (slot)
-    {
-      slot->state = Slot::State::Loading;
+  if (crc32c(src, payload.packedsize) == checksum)
+    return true;
 
-      slot->asset = static_cast<AssetEx*>(const_cast<Asset*>(asset));
+  // packs built before the switch to CRC32C carry the older xor checksum
 
-      platform.submit_work(background_loader, this, slot);
-    }
+  uint32_t legacy = 0;
 
-    return nullptr;
-  }
+  for(size_t i = 0; i < payload.packedsize; ++i)
+    legacy ^= static_cast<uint8_t const*>(src)[i] << (i % 4);
 
-  touch_slot(slot);
+  if (legacy == checksum)
+    return true;
 
-  if (slot->state != Slot::State::Loaded)
-    return nullptr;
+  cerr << "Background Load Error: Payload checksum mismatch" << endl;
 
-  return slot->data;
+  return false;
 }
 
 
-///////////////////////// AssetManager::aquire_barrier //////////////////////
-uintptr_t AssetManager::aquire_barrier()
+///////////////////////// AssetManager::decode_payload //////////////////////
+void AssetManager::decode_payload(Payload const &payload, void const *src, void *dst)
 {
-  lock_guard<mutex> lock(m_mutex);
+  switch (static_cast<PackCodec>(payload.codec))
+  {
+    case PackCodec::None:
+      memmove(dst, src, payload.datasize);
+      break;
 
-  auto slot = aquire_slot(0);
+    case PackCodec::LZ4:
+      if (!lz4_decompress(src, payload.packedsize, dst, payload.datasize))
+        cerr << "Background Load Error: Invalid compressed data" << endl;
+      break;
 
-  if (slot)
-  {
-    slot->state = Slot::State::Barrier;
+    default:
+      cerr << "Background Load Error: Unknown codec" << endl;
   }
+}
 
-  return reinterpret_cast<uintptr_t>(slot);
+
+///////////////////////// AssetManager::decoded_position ////////////////////
+size_t AssetManager::decoded_position(Payload const &payload)
+{
+  // behind the payload storage and the checksum read with it
+
+  return (payload_storage(payload) + sizeof(uint32_t) + alignof(AssetFont) - 1) & -alignof(AssetFont);
 }
 
 
-///////////////////////// AssetManager::release_barrier /////////////////////
-void AssetManager::release_barrier(uintptr_t barrier)
+///////////////////////// AssetManager::decode_font /////////////////////////
+void AssetManager::decode_font(Payload const &payload, char *data) const
 {
-  lock_guard<mutex> lock(m_mutex);
+  auto font = new(data + decoded_position(payload)) AssetFont;
 
-  auto slot = reinterpret_cast<Slot*>(barrier);
+  auto kernings = reinterpret_cast<uint32_t*>(font + 1);
 
-  if (slot)
+  auto table = reinterpret_cast<PackFontPayload const *>(data);
+
+  auto glyphs = reinterpret_cast<PackGlyph const *>(data + sizeof(PackFontPayload));
+
+  font->atlas = 0;
+  font->glyphcount = 0;
+  font->glyphs = glyphs;
+  font->kerningcount = 0;
+  font->kerning = nullptr;
+  font->kernings = kernings;
+
+  fill_n(font->direct, AssetFont::DirectLimit, 0);
+
+  kernings[0] = 0;
+
+  if (payload.datasize < sizeof(PackFontPayload) || table->glyphcount > (payload.datasize - sizeof(PackFontPayload)) / sizeof(PackGlyph) || table->kerningcount > (payload.datasize - sizeof(PackFontPayload) - table->glyphcount * sizeof(PackGlyph)) / sizeof(PackKerning))
+  {
+    cerr << "Background Load Error: Invalid font payload" << endl;
+
+    return;
+  }
+
+  font->atlas = find(static_cast<AssetType>(table->atlas));
+  font->glyphcount = table->glyphcount;
+  font->kerningcount = table->kerningcount;
+  font->kerning = reinterpret_cast<PackKerning const *>(glyphs + table->glyphcount);
+
+  auto kerning = font->kerning;
+
+  for(uint32_t i = 0, k = 0; i < table->glyphcount; ++i)
   {
-    slot->state = Slot::State::Empty;
+    if (glyphs[i].codepoint < AssetFont::DirectLimit)
+      font->direct[glyphs[i].codepoint] = i + 1;
+
+    while (k < table->kerningcount && kerning[k].first < glyphs[i].codepoint)
+      ++k;
+
+    kernings[i] = k;
   }
+
+  kernings[table->glyphcount] = table->kerningcount;
 }
 
 
@@ -320,19 +2474,87 @@ void AssetManager::background_loader(HandmadePlatform::PlatformInterface &platfo
 
   auto &slot = *static_cast<Slot*>(rdata);
 
-  try
+  auto &payload = manager.m_payloads[slot.asset - 1];
+
+  auto src = slot.data + payload_storage(payload) - payload.packedsize;
+
+  if (manager.m_verify && !verify_payload(payload, src))
+  {
+    lock_guard<mutex> lock(manager.m_mutex);
+
+    manager.discard_slot(&slot);
+
+    return;
+  }
+
+  if (payload.codec != static_cast<uint32_t>(PackCodec::None))
+    decode_payload(payload, src, slot.data);
+
+  if (payload.decodedsize != 0)
+    manager.decode_font(payload, slot.data);
+
   {
-    platform.read_handle(slot.asset->filehandle, slot.asset->datapos + sizeof(PackChunk), slot.data, slot.asset->datasize);
+    lock_guard<mutex> lock(manager.m_mutex);
+
+    slot.state = Slot::State::Loaded;
+
+    manager.heap_insert(&slot);
   }
-  catch(exception &e)
+}
+
+
+///////////////////////// AssetManager::batch_loader ////////////////////////
+void AssetManager::batch_loader(HandmadePlatform::PlatformInterface &platform, void *ldata, void *rdata)
+{
+  auto &manager = *static_cast<AssetManager*>(ldata);
+
+  auto &staging = *static_cast<Slot*>(rdata);
+
+  auto batch = reinterpret_cast<Batch*>(staging.data);
+
+  auto header = (sizeof(Batch) + batch->count*sizeof(Slot*) + alignof(Slot) - 1) & -alignof(Slot);
+
+  for(size_t i = 0; i < batch->count; ++i)
   {
-    cerr << "Background Read Error: " << e.what() << endl;
+    auto slot = batch->slots[i];
+
+    auto &payload = manager.m_payloads[slot->asset - 1];
+
+    auto src = staging.data + header + (payload_position(payload) - batch->position);
+
+    if (manager.m_verify && !verify_payload(payload, src))
+    {
+      {
+        lock_guard<mutex> lock(manager.m_mutex);
+
+        manager.discard_slot(slot);
+      }
+
+      batch->slots[i] = nullptr;
+
+      continue;
+    }
+
+    decode_payload(payload, src, slot->data);
+
+    if (payload.decodedsize != 0)
+      manager.decode_font(payload, slot->data);
   }
 
   {
     lock_guard<mutex> lock(manager.m_mutex);
 
-    slot.state = Slot::State::Loaded;
+    for(size_t i = 0; i < batch->count; ++i)
+    {
+      if (!batch->slots[i])
+        continue;
+
+      batch->slots[i]->state = Slot::State::Loaded;
+
+      manager.heap_insert(batch->slots[i]);
+    }
+
+    manager.release_slot(&staging);
   }
 }
 
@@ -340,113 +2562,111 @@ void AssetManager::background_loader(HandmadePlatform::PlatformInterface &platfo
 ///////////////////////// initialise_asset_system ///////////////////////////
 void initialise_asset_system(HandmadePlatform::PlatformInterface &platform, AssetManager &assetmanager)
 {
-  std::vector<Asset, StackAllocator<Asset>> assets(platform.gamescratchmemory);
+  std::vector<HandmadePlatform::PlatformInterface::handle_t, StackAllocator<HandmadePlatform::PlatformInterface::handle_t>> handles(platform.gamescratchmemory);
 
   auto hhas = platform.open_type_enumerator("hha");
 
   while (auto handle = platform.iterate_type_enumerator(hhas))
+  {
+    handles.push_back(handle);
+  }
+
+  platform.close_type_enumerator(hhas);
+
+  // warm start from the asset cache if no pack has changed
+
+  auto keys = allocate<AssetCachePack>(platform.gamescratchmemory, handles.size());
+
+  for(size_t i = 0; i < handles.size(); ++i)
   {
     try
     {
-      PackHeader header;
-
-      platform.read_handle(handle, 0, &header, sizeof(header));
+      keys[i] = read_cache_key(platform, handles[i]);
+    }
+    catch(std::exception &e)
+    {
+      keys[i] = {};
+    }
+  }
 
-      if (header.signature[0] != 0xCA || header.signature[1] != 'H' || header.signature[2] != 'H' || header.signature[3] != 'A')
-        throw runtime_error("Invalid hha file");
+  std::vector<Asset, StackAllocator<Asset>> assets(platform.gamescratchmemory);
 
-      uint64_t position = sizeof(header);
+  if (read_asset_cache(platform, keys, handles.data(), handles.size(), assets))
+  {
+    assetmanager.initialise(assets, 512*1024*1024);
 
-      Asset asset(platform.gamescratchmemory);
+    return;
+  }
 
-      asset.filehandle = handle;
+  // parse the packs on the work queue, each into its own slice of scratch memory
 
-      while (true)
-      {
-        PackChunk chunk;
+  PackLoader loader;
 
-        platform.read_handle(handle, position, &chunk, sizeof(chunk));
+  loader.remaining = handles.size();
 
-        if (chunk.type == 0x444e4548) // HEND
-          break;
+  auto packs = allocate<PackLoad>(platform.gamescratchmemory, handles.size());
 
-        switch (chunk.type)
-        {
-          case 0x54455341: // ASET
-            {
-              PackAssetHeader aset;
+  auto arenasize = ((platform.gamescratchmemory.capacity - platform.gamescratchmemory.size) / 2 / max(handles.size(), size_t(1))) & -alignof(max_align_t);
 
-              platform.read_handle(handle, position + sizeof(chunk), &aset, sizeof(aset));
+  for(size_t i = 0; i < handles.size(); ++i)
+  {
+    HandmadePlatform::GameMemory arena = { 0, arenasize, allocate<char, alignof(max_align_t)>(platform.gamescratchmemory, arenasize) };
 
-              asset.type = static_cast<AssetType>(aset.type);
+    new(&packs[i]) PackLoad(handles[i], arena);
 
-              asset.tags = {};
+    platform.submit_work(pack_loader, &loader, &packs[i]);
+  }
 
-              break;
-            }
+  {
+    unique_lock<mutex> lock(loader.mutex);
 
-          case 0x47415441: // ATAG
-            {
-              PackAssetTag atag;
+    while (loader.remaining != 0)
+    {
+      loader.signal.wait(lock);
+    }
+  }
 
-              platform.read_handle(handle, position + sizeof(chunk), &atag, sizeof(atag));
+  // packs that outgrew their slice are parsed again one at a time, each
+  // with the rest of scratch memory, handing back what it left unused
 
-              asset.tags.push_back({ static_cast<AssetTagId>(atag.id), atag.value });
+  for(size_t i = 0; i < handles.size(); ++i)
+  {
+    if (packs[i].overflow)
+    {
+      auto &scratch = platform.gamescratchmemory;
 
-              break;
-            }
+      auto arenasize = (scratch.capacity - scratch.size - alignof(max_align_t)) & -alignof(max_align_t);
 
-          case 0x52444849: // IHDR
-            {
-              PackImageHeader ihdr;
+      HandmadePlatform::GameMemory arena = { 0, arenasize, allocate<char, alignof(max_align_t)>(scratch, arenasize) };
 
-              platform.read_handle(handle, position + sizeof(chunk), &ihdr, sizeof(ihdr));
+      packs[i].~PackLoad();
 
-              asset.width = ihdr.width;
-              asset.height = ihdr.height;
-              asset.aspect = (float)asset.width / (float)asset.height;
-              asset.alignx = ihdr.alignx;
-              asset.aligny = ihdr.aligny;
-              asset.datapos = ihdr.dataoffset;
-              asset.datasize = ihdr.width * ihdr.height * sizeof(uint32_t);
+      new(&packs[i]) PackLoad(handles[i], arena);
 
-              break;
-            }
+      loader.remaining = 1;
 
-          case 0x52444846: // FHDR
-            {
-              PackFontHeader fhdr;
+      pack_loader(platform, &loader, &packs[i]);
 
-              platform.read_handle(handle, position + sizeof(chunk), &fhdr, sizeof(fhdr));
+      scratch.size = static_cast<char*>(packs[i].arena.data) + packs[i].arena.size - static_cast<char*>(scratch.data);
 
-              asset.ascent = fhdr.ascent;
-              asset.descent = fhdr.descent;
-              asset.leading = fhdr.leading;
-              asset.datapos = fhdr.dataoffset;
-              asset.datasize = fhdr.datasize;
+      if (packs[i].overflow)
+        cerr << "Error on asset file : out of scratch memory" << endl;
+    }
+  }
 
-              break;
-            }
+  size_t count = 0;
 
-          case 0x444e4541: // AEND
-            {
-              assets.push_back(asset);
+  for(size_t i = 0; i < handles.size(); ++i)
+    count += packs[i].assets.size();
 
-              break;
-            }
-        }
+  assets.reserve(count);
 
-        position += chunk.length + sizeof(chunk) + sizeof(uint32_t);
-      }
-    }
-    catch(std::exception &e)
-    {
-      cerr << "Error on asset file : " << e.what() << endl;
-    }
+  for(size_t i = 0; i < handles.size(); ++i)
+  {
+    assets.insert(assets.end(), packs[i].assets.begin(), packs[i].assets.end());
   }
 
-  platform.close_type_enumerator(hhas);
+  write_asset_cache(platform, keys, handles.data(), handles.size(), assets);
 
   assetmanager.initialise(assets, 512*1024*1024);
 }
-
@@ -13,7 +13,6 @@
 #include "memory.h"
 #include <atomic>
 #include <vector>
-#include <unordered_map>
 #include <random>
 #include <mutex>
 
@@ -45,6 +44,39 @@ struct AssetTag
 //|---------------------- Asset ---------------------------------------------
 //|--------------------------------------------------------------------------
 
+// catalogue index of an asset, zero is no asset
+typedef uint32_t AssetId;
+
+struct AssetInfo
+{
+  union
+  {
+    struct // image info
+    {
+      int width;
+      int height;
+      float aspect;
+      float alignx;
+      float aligny;
+      int format;
+      int levels;
+    };
+
+    struct // audio info
+    {
+      int channels;
+    };
+
+    struct // font info
+    {
+      int ascent;
+      int descent;
+      int leading;
+    };
+  };
+};
+
+// metadata of one asset as read from a pack, the manager keeps it in its catalogue
 class Asset
 {
   public:
@@ -66,35 +98,76 @@ class Asset
     uint64_t datapos;
     std::size_t datasize;
 
-    union
-    {
-      struct // image info
-      {
-        int width;
-        int height;
-        float aspect;
-        float alignx;
-        float aligny;
-      };
+    uint32_t codec;
+    std::size_t packedsize;
 
-      struct // audio info
-      {
-        int channels;
-      };
+    uint64_t datahash;
 
-      struct // font info
-      {
-        int ascent;
-        int descent;
-        int leading;
-      };
-    };
+    uint32_t checksum; // of the data chunk
+
+    int level; // mip level of an image, non zero levels are reached through their base
+
+    uint32_t header; // IHDR or FHDR, the chunk the metadata was read from
+
+    AssetInfo info;
+};
+
+
+//|---------------------- AssetFont -----------------------------------------
+//|--------------------------------------------------------------------------
+
+struct PackGlyph;
+struct PackKerning;
+
+// font decoded once its payload loads, kept in the slot behind the payload
+struct AssetFont
+{
+  static const uint32_t DirectLimit = 0x800;
+
+  AssetId atlas;
+
+  uint32_t glyphcount;
+  PackGlyph const *glyphs;
+
+  uint32_t kerningcount;
+  PackKerning const *kerning;
+
+  uint32_t const *kernings; // first kerning pair of each glyph, glyphcount + 1 entries
+
+  uint32_t direct[DirectLimit]; // glyph index + 1 of the codepoints below the limit, zero for none
+
+  // glyph of a codepoint, null if the font has none
+  PackGlyph const *glyph(uint32_t codepoint) const;
+
+  // adjustment to the advance of first when followed by second
+  int kern(PackGlyph const *first, PackGlyph const *second) const;
 };
 
 
 //|---------------------- AssetManager --------------------------------------
 //|--------------------------------------------------------------------------
 
+enum class EvictionPolicy
+{
+  LRU,    // least recently used
+  CLOCK,  // second chance, sweeping the slab
+  LFU,    // least frequently used
+  GDSF,   // greedy dual size frequency, large rarely used payloads go first
+};
+
+struct AssetStats
+{
+  static const uint32_t RefetchFrames = 60;
+
+  uint64_t hits;        // requests answered from a loaded payload
+  uint64_t misses;      // requests that found their payload not loaded
+  uint64_t failures;    // misses that found no room to load into
+  uint64_t corrupt;     // loads dropped for a payload checksum mismatch
+  uint64_t evictions;
+  uint64_t reloadbytes; // bytes read again for payloads evicted earlier
+  uint64_t refetches;   // loads of payloads evicted within the last RefetchFrames frames
+};
+
 class AssetManager
 {
   public:
@@ -112,18 +185,56 @@ class AssetManager
     // initialise asset metadata
     void initialise(std::vector<Asset, StackAllocator<Asset>> const &assets, std::size_t slabsize);
 
-    // Find an asset by metadata
+    // Find an asset by metadata. Tagged lookups are memoised, so call from one thread only.
 
-    Asset const *find(AssetType type) const;
+    AssetId find(AssetType type) const;
 
     template<std::size_t N = 0>
-    Asset const *find(random_type &random, AssetType type, std::array<AssetTag, N> const &tags = {}, std::array<float, N> const &weights = []() { std::array<float, N> one; std::fill_n(one.data(), N, 1.0f); return one; }()) const
+    AssetId find(random_type &random, AssetType type, std::array<AssetTag, N> const &tags = {}, std::array<float, N> const &weights = []() { std::array<float, N> one; std::fill_n(one.data(), N, 1.0f); return one; }()) const
     {
       return find(random, type, tags.data(), weights.data(), N);
     }
 
-    // Request asset payload. May not be loaded, will initiate background load and return null.
-    void const *request(HandmadePlatform::PlatformInterface &platform, Asset const *asset);
+    // Image, audio or font info of an asset.
+    AssetInfo const &info(AssetId asset) const { return m_infos[asset - 1]; }
+
+    // Mip level of an image, clamped to the levels available. Level zero is the image itself.
+    AssetId mip(AssetId asset, int level) const;
+
+    // Request asset payload. May not be loaded, will queue a background load and return null.
+    void const *request(HandmadePlatform::PlatformInterface &platform, AssetId asset);
+
+    // Request the payload of a mip level of an image.
+    void const *request(HandmadePlatform::PlatformInterface &platform, AssetId asset, int level);
+
+    // Payload of an asset if already loaded, never queues a load.
+    void const *resident(AssetId asset);
+
+    // Request the decoded font of a font asset, null until loaded.
+    AssetFont const *font(HandmadePlatform::PlatformInterface &platform, AssetId asset);
+
+    // Issue the queued loads, coalescing reads of neighbouring payloads. Called
+    // from one thread at a time.
+    void flush(HandmadePlatform::PlatformInterface &platform);
+
+    // Check payload checksums as they load, set before the first request.
+    // Payloads that fail are dropped and never requested again.
+    void verify_payloads(bool enabled);
+
+    // Choose which loaded payloads make room for new ones.
+    void eviction_policy(EvictionPolicy policy);
+
+    // Cache statistics, counted separately for each policy while it is in use.
+    AssetStats stats(EvictionPolicy policy) const;
+
+    // Record the first use of each asset, for the builder to order payloads by.
+    void record_trace(HandmadePlatform::PlatformInterface &platform, const char *path);
+
+    // Slide loaded payloads down over the free space left between them, once
+    // allocations have failed for fragmentation. Skipped while a render group
+    // holds a barrier, payloads still loading stay where they are. Moves a few
+    // megabytes at most per call, call once a frame until done.
+    void compact();
 
   public:
 
@@ -133,7 +244,15 @@ class AssetManager
 
   protected:
 
-    Asset const *find(random_type &random, AssetType type, AssetTag const *tags, float const *weights, std::size_t n) const;
+    struct Matches;
+
+    AssetId find(random_type &random, AssetType type, AssetTag const *tags, float const *weights, std::size_t n) const;
+
+    void match(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, Matches &matches) const;
+
+    void match_linear(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, Matches &matches) const;
+
+    AssetId nth_match(AssetType type, AssetTag const *tags, float const *weights, std::size_t n, float factor, uint32_t selected) const;
 
   private:
 
@@ -143,14 +262,75 @@ class AssetManager
 
     struct Slot;
 
-    struct AssetEx : public Asset
+    struct TagRange
     {
-      AssetEx(Asset const &asset, allocator_type const &allocator);
+      uint32_t first;
+      uint32_t count;
+    };
 
-      Slot *slot;
+    struct Payload
+    {
+      HandmadePlatform::PlatformInterface::handle_t filehandle;
+
+      uint64_t datapos;
+      uint32_t datasize;
+      uint32_t packedsize;
+      uint32_t codec;
+
+      uint32_t decodedsize; // room for the decoded form behind the payload, fonts only
+
+      uint32_t checksum; // of the data chunk, names the payload in traces
+
+      bool corrupt; // failed its checksum, never loaded again
+    };
+
+    // catalogue, indexed by id - 1. Base assets come first grouped by type,
+    // mip levels follow and are reached through their base.
+
+    std::size_t m_basecount;
+
+    std::vector<AssetType, StackAllocator<AssetType>> m_types;
+    std::vector<TagRange, StackAllocator<TagRange>> m_tagranges;
+    std::vector<AssetInfo, StackAllocator<AssetInfo>> m_infos;
+    std::vector<Payload, StackAllocator<Payload>> m_payloads;
+
+    std::vector<AssetTag, StackAllocator<AssetTag>> m_tags;
+
+    // identical payloads load through one canonical asset and share its slot
+    std::vector<AssetId, StackAllocator<AssetId>> m_canonical;
+
+    // first of the mip levels 1..levels-1 of an image
+    std::vector<AssetId, StackAllocator<AssetId>> m_mips;
+
+    std::vector<Slot*, StackAllocator<Slot*>> m_slots;
+
+    std::vector<uint8_t, StackAllocator<uint8_t>> m_traced;
+
+    struct TagEntry
+    {
+      AssetType type;
+      AssetTagId id;
+      float value;
+
+      AssetId asset;
     };
 
-    std::unordered_multimap<AssetType, AssetEx, std::hash<AssetType>, std::equal_to<>, std::scoped_allocator_adaptor<allocator_type>> m_assets;
+    // tag values sorted by type, id and value
+    std::vector<TagEntry, StackAllocator<TagEntry>> m_tagindex;
+
+    // tag values of each type as columns over its assets, NaN where an asset
+    // lacks the tag, padded to whole blocks of eight for the batched scan
+    std::vector<AssetType, StackAllocator<AssetType>> m_columntypes;
+    std::vector<AssetTagId, StackAllocator<AssetTagId>> m_columnids;
+    std::vector<uint32_t, StackAllocator<uint32_t>> m_columnoffsets;
+    std::vector<float, StackAllocator<float, 32>> m_columnvalues;
+
+    struct Memo;
+
+    // tagged lookups by hash of their arguments, rebuilt with the catalogue
+    std::size_t m_memosize;
+
+    Memo *m_memo;
 
   private:
 
@@ -166,28 +346,166 @@ class AssetManager
 
       State state;
 
-      AssetEx *asset;
+      AssetId asset;
 
       std::size_t size;
 
-      Slot *after;
+      Slot *before; // neighbour below in the slab, null for the first
 
-      Slot *prev;
+      Slot *prev; // recency order while in use, barrier list or bin list otherwise
       Slot *next;
 
+      uint64_t stamp; // order of last use, barriers protect slots used after them
+
+      uint32_t hits;
+      bool referenced;
+
+      double priority;
+      std::size_t heapindex;
+
       alignas(16) char data[];
     };
 
+    // The slab is carved into slots. Empty slots sit in bins by size, two
+    // levels deep (power of two, then eighths), the rest in recency order
+    // from m_head, the least recently used.
+
+    static const int BinLevels = 64;
+    static const int BinSplitBits = 3;
+    static const int BinSplits = 1 << BinSplitBits;
+
+    char *m_slab;
+    char *m_slabend;
+
     Slot *m_head;
 
+    Slot *m_barriers;
+
+    uint64_t m_binmap;
+    uint8_t m_splitmap[BinLevels];
+    Slot *m_bins[BinLevels][BinSplits];
+
+    std::size_t m_freebytes;
+
+    bool m_fragmented;
+
     Slot *aquire_slot(std::size_t size);
 
     Slot *touch_slot(Slot *slot);
 
+    void link_slot(Slot *&list, Slot *slot);
+    void unlink_slot(Slot *&list, Slot *slot);
+
+    Slot *release_slot(Slot *slot);
+
+    void discard_slot(Slot *slot);
+
+    void bin_insert(Slot *slot);
+    void bin_remove(Slot *slot);
+
+    Slot *bin_search(std::size_t bytes) const;
+
+  private:
+
+    // Loaded slots are heaped by priority for the frequency policies, the
+    // clock hand sweeps the slab in address order.
+
+    EvictionPolicy m_policy;
+
+    uint64_t m_stamp;
+
+    double m_inflation;
+
+    Slot *m_hand;
+
+    std::vector<Slot*, StackAllocator<Slot*>> m_heap;
+
+    // frame + 1 of the last eviction of each payload, zero if never evicted
+    std::vector<uint32_t, StackAllocator<uint32_t>> m_evicted;
+
+    AssetStats m_stats[4];
+
+    Slot *choose_victim();
+
+    void hit_slot(Slot *slot);
+
+    double priority(Slot const *slot) const;
+
+    void heap_insert(Slot *slot);
+    void heap_remove(Slot *slot);
+    void heap_update(Slot *slot);
+
+    void heap_up(std::size_t index);
+    void heap_down(std::size_t index);
+
+    Slot *heap_victim(std::size_t index, uint64_t oldest) const;
+
+    static uint64_t payload_position(Payload const &payload);
+
+    static std::size_t payload_storage(Payload const &payload);
+
+    static bool verify_payload(Payload const &payload, void const *src);
+
+    static void decode_payload(Payload const &payload, void const *src, void *dst);
+
+    static std::size_t decoded_position(Payload const &payload);
+
+    void decode_font(Payload const &payload, char *data) const;
+
     static void background_loader(HandmadePlatform::PlatformInterface &platform, void *ldata, void *rdata);
 
   private:
 
+    struct Batch
+    {
+      uint64_t position;
+      std::size_t count;
+
+      Slot *slots[];
+    };
+
+    std::size_t m_pendingcount;
+    std::size_t m_pendingcapacity;
+
+    Slot **m_pending;
+
+    // reads gathered by flush under the lock, issued once it is released
+
+    struct Read
+    {
+      HandmadePlatform::PlatformInterface::handle_t filehandle;
+
+      uint64_t position;
+      char *buffer;
+      std::size_t size;
+
+      void (*loader)(HandmadePlatform::PlatformInterface &, void *, void *);
+
+      Slot *slot;
+    };
+
+    Read *m_reads;
+
+    static void batch_loader(HandmadePlatform::PlatformInterface &platform, void *ldata, void *rdata);
+
+  private:
+
+    uint32_t m_frame;
+
+    HandmadePlatform::PlatformInterface::handle_t m_trace;
+
+    uint64_t m_traceposition;
+
+    std::size_t m_tracecount;
+
+    AssetId *m_tracebuffer;
+
+    void write_trace(HandmadePlatform::PlatformInterface &platform);
+
+  private:
+
+    bool m_verify;
+
     mutable std::mutex m_mutex;
 };
 
@@ -11,6 +11,21 @@
 
 #include "platform.h"
 
+enum class PackCodec : uint32_t
+{
+  None = 0,
+  LZ4 = 1,
+};
+
+enum class PackImageFormat : uint32_t
+{
+  BGRA = 0,   // premultiplied 32 bit
+  A8 = 1,     // alpha only, premultiplied white
+  BC1 = 2,    // 4x4 blocks, 8 bytes, punch through alpha
+  BC3 = 3,    // 4x4 blocks, 16 bytes, interpolated alpha
+  BC7 = 4,    // 4x4 blocks, 16 bytes, mode 6 only
+};
+
 #pragma pack(push, 1)
 
 struct PackHeader
@@ -42,6 +57,12 @@ struct PackImageHeader
   float alignx;
   float aligny;
   uint64_t dataoffset;
+  uint32_t codec;
+  uint32_t packedsize;
+  uint64_t datahash; // identical payloads share a data chunk
+  uint32_t format;
+  uint32_t level;    // mip level, written as its own asset following its base image
+  uint32_t checksum; // of the data chunk, as traced by the runtime
 };
 
 struct PackSoundHeader
@@ -57,13 +78,74 @@ struct PackFontHeader
   uint32_t leading;
   uint32_t datasize;
   uint64_t dataoffset;
+  uint32_t codec;
+  uint32_t packedsize;
+  uint64_t datahash;
+  uint32_t checksum; // of the data chunk, as traced by the runtime
 };
 
 struct PackFontPayload
 {
-  uint32_t count;
-  // uint32_t type[count];
-  // uint8_t kerning[count][count];
+  uint32_t glyphcount;
+  uint32_t kerningcount;
+  uint32_t atlas; // asset type of the glyph atlas image
+  // PackGlyph glyphs[glyphcount];      sorted by codepoint
+  // PackKerning kerning[kerningcount]; sorted by codepoint pair
+};
+
+struct PackGlyph
+{
+  uint32_t codepoint;
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;  // texel rect within the atlas, zero width for no glyph
+  uint16_t height;
+  float alignx;
+  float aligny;
+  int32_t advance;
+};
+
+struct PackKerning
+{
+  uint32_t first;
+  uint32_t second;
+  int16_t advance; // adjustment to the advance of first when followed by second
+};
+
+struct PackTocHeader
+{
+  uint32_t assetcount;
+  uint32_t tagcount;
+  // PackTocEntry entries[assetcount];
+  // PackAssetTag tags[tagcount];
+};
+
+struct PackTocEntry
+{
+  uint32_t type;
+  uint32_t tagindex;
+  uint32_t tagcount;
+  uint32_t header; // IHDR or FHDR
+
+  union
+  {
+    PackImageHeader ihdr;
+    PackFontHeader fhdr;
+  };
+};
+
+struct PackTraceHeader
+{
+  uint8_t signature[8];
+  uint32_t version;
+  // PackTraceEntry entries[];
+};
+
+struct PackTraceEntry
+{
+  uint32_t frame;
+  uint32_t checksum; // payload chunk checksum
+  uint32_t packedsize;
 };
 
 #pragma pack(pop)
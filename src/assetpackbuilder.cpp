@@ -9,19 +9,241 @@
 
 #include <QGuiApplication>
 #include <QImage>
+#include <QImageReader>
 #include <QFont>
 #include <QFontMetrics>
 #include <QPainter>
-#include <QFile>
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <iterator>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <numeric>
+#include <algorithm>
 #include "asset.h"
 #include "assetpack.h"
+#include "compression.h"
+#include "checksum.h"
+#include "blockcompression.h"
 
 using namespace std;
 
 const float PI = 3.14159265359;
 
+// bump to invalidate every build manifest when the builder output changes
+const uint32_t BuildVersion = 10;
+
+
+//|---------------------- BuildQueue ----------------------------------------
+//|--------------------------------------------------------------------------
+
+class BuildQueue
+{
+  public:
+
+    struct Group
+    {
+      size_t remaining = 0;
+
+      exception_ptr error;
+    };
+
+  public:
+
+    BuildQueue(size_t threads);
+    ~BuildQueue();
+
+    void submit(Group &group, function<void()> &&job);
+
+    // waits for the group to finish, running queued jobs in the meantime
+    void wait(Group &group);
+
+  private:
+
+    struct Job
+    {
+      Group *group;
+
+      function<void()> func;
+    };
+
+    void run(unique_lock<mutex> &lock);
+
+    bool m_done;
+
+    deque<Job> m_jobs;
+
+    mutex m_mutex;
+    condition_variable m_signal;
+
+    vector<thread> m_threads;
+};
+
+
+///////////////////////// BuildQueue::Constructor ///////////////////////////
+BuildQueue::BuildQueue(size_t threads)
+{
+  m_done = false;
+
+  for(size_t i = 0; i < threads; ++i)
+  {
+    m_threads.push_back(thread([this]() {
+
+      unique_lock<mutex> lock(m_mutex);
+
+      while (!m_done)
+      {
+        if (m_jobs.empty())
+          m_signal.wait(lock);
+        else
+          run(lock);
+      }
+
+    }));
+  }
+}
+
+
+///////////////////////// BuildQueue::Destructor ////////////////////////////
+BuildQueue::~BuildQueue()
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+
+    m_done = true;
+
+    m_signal.notify_all();
+  }
+
+  for(auto &thread : m_threads)
+    thread.join();
+}
+
+
+///////////////////////// BuildQueue::submit ////////////////////////////////
+void BuildQueue::submit(Group &group, function<void()> &&job)
+{
+  lock_guard<mutex> lock(m_mutex);
+
+  group.remaining += 1;
+
+  m_jobs.push_back({ &group, std::move(job) });
+
+  m_signal.notify_one();
+}
+
+
+///////////////////////// BuildQueue::wait //////////////////////////////////
+void BuildQueue::wait(Group &group)
+{
+  unique_lock<mutex> lock(m_mutex);
+
+  while (group.remaining != 0)
+  {
+    if (m_jobs.empty())
+      m_signal.wait(lock);
+    else
+      run(lock);
+  }
+
+  if (group.error)
+    rethrow_exception(group.error);
+}
+
+
+///////////////////////// BuildQueue::run ///////////////////////////////////
+void BuildQueue::run(unique_lock<mutex> &lock)
+{
+  auto job = std::move(m_jobs.front());
+
+  m_jobs.pop_front();
+
+  lock.unlock();
+
+  exception_ptr error;
+
+  try
+  {
+    job.func();
+  }
+  catch(...)
+  {
+    error = current_exception();
+  }
+
+  lock.lock();
+
+  if (error && !job.group->error)
+    job.group->error = error;
+
+  job.group->remaining -= 1;
+
+  m_signal.notify_all();
+}
+
+
+//|---------------------- BuildAsset ----------------------------------------
+//|--------------------------------------------------------------------------
+
+struct BuildAsset
+{
+  uint32_t type;
+
+  vector<PackAssetTag> tags;
+
+  uint32_t header; // IHDR or FHDR
+
+  union
+  {
+    PackImageHeader ihdr;
+    PackFontHeader fhdr;
+  };
+
+  uint32_t datatype; // IDAT or FDAT
+
+  vector<char> payload;
+
+  uint32_t checksum;
+
+  string name;
+
+  // content hash of the build parameters, completed with the source files
+  uint64_t hash;
+
+  vector<string> sources;
+
+  // loads and converts the source, then calls build_payload; the queue is
+  // available to split the work further
+  function<void(BuildQueue &, BuildAsset &)> build;
+
+  // assets following this one that its build fills in as well, the mip levels
+  // of an image; they have no sources or build of their own
+  size_t chained;
+};
+
+
+uint64_t fnv(void const *data, size_t n, uint64_t hash = 14695981039346656037ull)
+{
+  for(size_t i = 0; i < n; ++i)
+    hash = (hash ^ static_cast<uint8_t const*>(data)[i]) * 1099511628211ull;
+
+  return hash;
+}
+
+
+uint64_t fnv(const char *str, uint64_t hash)
+{
+  return fnv(str, strlen(str) + 1, hash);
+}
+
 
 void write_header(ostream &fout)
 {
@@ -33,13 +255,8 @@ void write_header(ostream &fout)
 }
 
 
-void write_chunk(ostream &fout, const char type[4], uint32_t length, void const *data)
+void write_chunk(ostream &fout, const char type[4], uint32_t length, void const *data, uint32_t checksum)
 {
-  uint32_t checksum = 0;
-
-  for(size_t i = 0; i < length; ++i)
-    checksum ^= static_cast<uint8_t const*>(data)[i] << (i % 4);
-
   fout.write((char*)&length, sizeof(length));
   fout.write((char*)type, 4);
   fout.write((char*)data, length);
@@ -47,311 +264,1211 @@ void write_chunk(ostream &fout, const char type[4], uint32_t length, void const
 }
 
 
-void write_compressed_chunk(ostream &fout, const char type[4], uint32_t length, void const *data)
+void write_chunk(ostream &fout, const char type[4], uint32_t length, void const *data)
 {
-  write_chunk(fout, type, length, data);
+  write_chunk(fout, type, length, data, crc32c(data, length));
 }
 
 
-void write_image_asset(ostream &fout, AssetType type, const char *path, float alignx, float aligny, std::vector<AssetTag> const &tags = {})
+void build_payload(BuildAsset &asset, const char type[4], uint32_t length, void const *data)
 {
-  QImage image(path);
+  memcpy(&asset.datatype, type, sizeof(asset.datatype));
 
-  image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+  asset.payload.resize(lz4_compress_bound(length));
 
-  PackAssetHeader aset = { static_cast<uint32_t>(type) };
+  auto size = lz4_compress(data, length, asset.payload.data(), asset.payload.size());
 
-  write_chunk(fout, "ASET", sizeof(aset), &aset);
+  auto codec = PackCodec::LZ4;
 
-  for(auto &tag : tags)
+  if (size == 0 || size >= length)
   {
-    PackAssetTag atag = { static_cast<uint32_t>(tag.id), tag.value };
+    // store raw when compression does not help
 
-    write_chunk(fout, "ATAG", sizeof(atag), &atag);
+    asset.payload.assign(static_cast<char const *>(data), static_cast<char const *>(data) + length);
+
+    codec = PackCodec::None;
   }
 
-  PackImageHeader ihdr = { (uint32_t)image.width(), (uint32_t)image.height(), alignx, aligny, (size_t)fout.tellp() + sizeof(ihdr) + sizeof(PackChunk) + sizeof(uint32_t) };
+  asset.payload.resize((codec == PackCodec::None) ? length : size);
 
-  write_chunk(fout, "IHDR", sizeof(ihdr), &ihdr);
+  asset.checksum = crc32c(asset.payload.data(), asset.payload.size());
 
-  write_chunk(fout, "IDAT", image.byteCount(), image.bits());
+  // content hash of the decoded payload, zero is reserved for unhashed
 
-  write_chunk(fout, "AEND", 0, nullptr);
+  auto datahash = max(fnv(data, length, fnv(type, sizeof(asset.datatype))), uint64_t(1));
+
+  if (asset.header == 0x52444849) // IHDR
+  {
+    asset.ihdr.codec = static_cast<uint32_t>(codec);
+    asset.ihdr.packedsize = asset.payload.size();
+    asset.ihdr.datahash = datahash;
+    asset.ihdr.checksum = asset.checksum;
+  }
 
-  cout << "  " << path << endl;
+  if (asset.header == 0x52444846) // FHDR
+  {
+    asset.fhdr.codec = static_cast<uint32_t>(codec);
+    asset.fhdr.packedsize = asset.payload.size();
+    asset.fhdr.datahash = datahash;
+    asset.fhdr.checksum = asset.checksum;
+  }
 }
 
 
-void write_font_asset(ostream &fout, const char *fontname, uint32_t startid, std::vector<AssetTag> const &tags = {})
+BuildAsset make_asset(uint32_t type, std::vector<AssetTag> const &tags)
 {
-  QFont font(fontname, 48);
+  BuildAsset asset = {};
+
+  asset.type = type;
 
-  QFontMetrics tm(font);
+  for(auto &tag : tags)
+  {
+    asset.tags.push_back({ static_cast<uint32_t>(tag.id), tag.value });
+  }
 
-  PackAssetHeader aset = { static_cast<uint32_t>(AssetType::Font) };
+  asset.hash = fnv(&BuildVersion, sizeof(BuildVersion));
+  asset.hash = fnv(&asset.type, sizeof(asset.type), asset.hash);
+  asset.hash = fnv(asset.tags.data(), asset.tags.size() * sizeof(PackAssetTag), asset.hash);
 
-  write_chunk(fout, "ASET", sizeof(aset), &aset);
+  return asset;
+}
 
-  for(auto &tag : tags)
+
+QImage downsample(QImage const &image)
+{
+  // 2x2 box filter over premultiplied texels, odd edges clamp
+
+  int width = max(image.width() / 2, 1);
+  int height = max(image.height() / 2, 1);
+
+  QImage result(width, height, QImage::Format_ARGB32_Premultiplied);
+
+  for(int y = 0; y < height; ++y)
   {
-    PackAssetTag atag = { static_cast<uint32_t>(tag.id), tag.value };
+    auto row0 = image.constScanLine(min(2*y, image.height() - 1));
+    auto row1 = image.constScanLine(min(2*y + 1, image.height() - 1));
 
-    write_chunk(fout, "ATAG", sizeof(atag), &atag);
+    auto dst = result.scanLine(y);
+
+    for(int x = 0; x < width; ++x)
+    {
+      int x0 = 4 * min(2*x, image.width() - 1);
+      int x1 = 4 * min(2*x + 1, image.width() - 1);
+
+      for(int k = 0; k < 4; ++k)
+      {
+        dst[4*x + k] = (row0[x0 + k] + row0[x1 + k] + row1[x0 + k] + row1[x1 + k] + 2) >> 2;
+      }
+    }
   }
 
-  int count = 127;
+  return result;
+}
+
+
+vector<uint8_t> compress_blocks(BuildQueue &queue, PackImageFormat format, QImage const &image)
+{
+  BlockFormat blockformat;
+
+  switch (format)
+  {
+    case PackImageFormat::BC1:
+      blockformat = BlockFormat::BC1;
+      break;
+
+    case PackImageFormat::BC3:
+      blockformat = BlockFormat::BC3;
+      break;
+
+    case PackImageFormat::BC7:
+      blockformat = BlockFormat::BC7;
+      break;
+
+    default:
+      throw runtime_error("not a block format");
+  }
+
+  vector<uint8_t> blocks(block_compressed_size(blockformat, image.width(), image.height()));
+
+  // one job per block row, rows write disjoint ranges of the output
+
+  auto bits = image.constBits();
 
-  size_t datasize = sizeof(PackFontPayload) + count*sizeof(uint32_t) + count*count*sizeof(uint8_t);
+  BuildQueue::Group group;
+
+  for(int row = 0; row < (image.height() + 3) / 4; ++row)
+  {
+    queue.submit(group, [&, row]() { block_compress(blockformat, bits, image.width(), image.height(), row, row + 1, blocks.data()); });
+  }
+
+  queue.wait(group);
+
+  return blocks;
+}
 
-  PackFontHeader fhdr = { (uint32_t)tm.ascent(), (uint32_t)tm.descent(), (uint32_t)tm.leading(), (uint32_t)datasize, (size_t)fout.tellp() + sizeof(fhdr) + sizeof(PackChunk) + sizeof(uint32_t) };
 
-  write_chunk(fout, "FHDR", sizeof(fhdr), &fhdr);
+void add_image_asset(std::vector<BuildAsset> &assets, AssetType type, string const &path, float alignx, float aligny, PackImageFormat format, std::vector<AssetTag> const &tags = {})
+{
+  // only the dimensions are read here, they fix the length of the mip chain
 
-  unique_ptr<char[]> data(new char[datasize]);
+  auto size = QImageReader(path.c_str()).size();
 
-  memcpy(data.get(), &count, sizeof(count));
+  int levels = 1;
 
-  auto glyphtable = reinterpret_cast<uint32_t*>(data.get() + sizeof(PackFontPayload));
-  auto kerningtable = reinterpret_cast<uint8_t*>(data.get() + sizeof(PackFontPayload) + count * sizeof(uint32_t));
+  for(int width = size.width(), height = size.height(); width > 1 || height > 1; width = max(width / 2, 1), height = max(height / 2, 1))
+    ++levels;
 
-  for(int codepoint = 0; codepoint < count; ++codepoint)
+  for(int level = 0; level < levels; ++level)
   {
-    glyphtable[codepoint] = startid + codepoint;
+    auto asset = make_asset(static_cast<uint32_t>(type), (level == 0) ? tags : std::vector<AssetTag>{});
+
+    asset.name = (level == 0) ? path : path + " level " + to_string(level);
+
+    asset.hash = fnv(&alignx, sizeof(alignx), asset.hash);
+    asset.hash = fnv(&aligny, sizeof(aligny), asset.hash);
+    asset.hash = fnv(&format, sizeof(format), asset.hash);
+    asset.hash = fnv(&level, sizeof(level), asset.hash);
+
+    assets.push_back(std::move(asset));
   }
 
-  for(int codepoint = 0; codepoint < count; ++codepoint)
-  {    
-    kerningtable[codepoint] = 0;
+  // the base image builds the whole chain, each level filtered from the one before
+
+  auto &base = assets[assets.size() - levels];
+
+  base.sources.push_back(path);
+
+  base.chained = levels - 1;
+
+  base.build = [=](BuildQueue &queue, BuildAsset &base) {
+
+    QImage image(path.c_str());
+
+    image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
 
-    for(int othercodepoint = 1; othercodepoint < count; ++othercodepoint)
+    for(int level = 0; level < levels; ++level)
     {
-      kerningtable[othercodepoint * count + codepoint] = tm.width(QString(QChar(othercodepoint)) + QString(QChar(codepoint))) - tm.width(QChar(codepoint));
+      if (level != 0)
+        image = downsample(image);
+
+      auto &asset = (&base)[level];
+
+      asset.header = 0x52444849; // IHDR
+      asset.ihdr = { (uint32_t)image.width(), (uint32_t)image.height(), alignx, aligny };
+      asset.ihdr.format = static_cast<uint32_t>(format);
+      asset.ihdr.level = level;
+
+      if (format == PackImageFormat::BGRA)
+      {
+        build_payload(asset, "IDAT", image.byteCount(), image.bits());
+      }
+      else
+      {
+        auto blocks = compress_blocks(queue, format, image);
+
+        build_payload(asset, "IDAT", blocks.size(), blocks.data());
+      }
     }
-  }
+  };
+}
 
-  write_chunk(fout, "FDAT", datasize, data.get());
 
-  write_chunk(fout, "AEND", 0, nullptr);
+QString glyph_string(uint32_t codepoint)
+{
+  return QString::fromUcs4(reinterpret_cast<uint const *>(&codepoint), 1);
+}
+
+
+vector<uint32_t> glyph_codepoints(std::vector<pair<uint32_t, uint32_t>> const &ranges)
+{
+  vector<uint32_t> codepoints;
 
-  for(int codepoint = 33; codepoint < count; ++codepoint)
+  for(auto &range : ranges)
   {
-    QString str = QChar(codepoint);
+    for(uint32_t codepoint = range.first; codepoint <= range.second; ++codepoint)
+      codepoints.push_back(codepoint);
+  }
 
-    QImage image(tm.width(str)+2, tm.height()+2, QImage::Format_ARGB32_Premultiplied);
+  sort(codepoints.begin(), codepoints.end());
 
-    image.fill(0x00000000);
+  codepoints.erase(unique(codepoints.begin(), codepoints.end()), codepoints.end());
+
+  return codepoints;
+}
+
+
+vector<PackGlyph> layout_glyphs(QFontMetrics const &tm, vector<uint32_t> const &codepoints, int *width, int *height)
+{
+  vector<PackGlyph> glyphs(codepoints.size(), PackGlyph{});
+
+  // shelf pack in codepoint order, doubling the width until roughly square
 
+  for(*width = 64; ; *width *= 2)
+  {
+    int x = 0, y = 0, rowheight = 0;
+
+    for(size_t i = 0; i < codepoints.size(); ++i)
     {
-      QPainter painter(&image);
+      auto str = glyph_string(codepoints[i]);
 
-      painter.setFont(font);
-      painter.setPen(Qt::white);
-      painter.drawText(image.rect().adjusted(1, 1, -1, -1), str);
-    }
+      glyphs[i] = { codepoints[i] };
 
-    float alignx = 1.0f / image.width();
-    float aligny = (1.0f + tm.descent()) / image.height();
+      glyphs[i].advance = tm.width(str);
 
-    PackAssetHeader aset = { startid + codepoint };
+      if (QChar::isSpace(codepoints[i]))
+        continue;
 
-    write_chunk(fout, "ASET", sizeof(aset), &aset);
+      int w = tm.width(str) + 2;
+      int h = tm.height() + 2;
 
-    PackImageHeader ihdr = { (uint32_t)image.width(), (uint32_t)image.height(), alignx, aligny, (size_t)fout.tellp() + sizeof(ihdr) + sizeof(PackChunk) + sizeof(uint32_t) };
+      if (x + w > *width)
+      {
+        x = 0;
+        y += rowheight;
+        rowheight = 0;
+      }
 
-    write_chunk(fout, "IHDR", sizeof(ihdr), &ihdr);
+      glyphs[i].x = x;
+      glyphs[i].y = y;
+      glyphs[i].width = w;
+      glyphs[i].height = h;
+      glyphs[i].alignx = 1.0f / w;
+      glyphs[i].aligny = (1.0f + tm.descent()) / h;
+
+      x += w;
+      rowheight = max(rowheight, h);
+    }
 
-    write_chunk(fout, "IDAT", image.byteCount(), image.bits());
+    *height = y + rowheight;
 
-    write_chunk(fout, "AEND", 0, nullptr);
+    if (*height <= *width)
+      break;
   }
 
-  cout << "  " << fontname << endl;
+  return glyphs;
 }
 
 
-void compress(const char *path)
+vector<PackKerning> kerning_pairs(QFontMetrics const &tm, vector<uint32_t> const &codepoints, std::vector<pair<uint32_t, uint32_t>> const &kernranges)
 {
-  ifstream fin(path, ios::binary);
+  vector<PackKerning> pairs;
 
-  fstream fout("tmp.hha", ios::in | ios ::out | ios::binary | ios::trunc);
+  // every pair costs a layout, so the search is limited to the glyphs within
+  // the kerning ranges, each measured on its own once
 
-  write_header(fout);
+  vector<uint32_t> candidates;
 
-  // First Pass, add asset metadata
+  for(auto codepoint : codepoints)
+  {
+    if (any_of(kernranges.begin(), kernranges.end(), [&](auto &range) { return range.first <= codepoint && codepoint <= range.second; }))
+      candidates.push_back(codepoint);
+  }
 
-  fin.seekg(sizeof(PackHeader), ios::beg);
+  vector<QString> strs;
+  vector<int> widths;
 
-  while (fin)
+  for(auto codepoint : candidates)
   {
-    PackChunk chunk;
+    strs.push_back(glyph_string(codepoint));
+    widths.push_back(tm.width(strs.back()));
+  }
 
-    fin.read((char*)&chunk, sizeof(chunk));
+  for(size_t i = 0; i < candidates.size(); ++i)
+  {
+    for(size_t j = 0; j < candidates.size(); ++j)
+    {
+      // only pairs whose combined width differs from the sum of their advances
 
-    if (chunk.type == 0x444e4548) // HEND
-      break;
+      int advance = tm.width(strs[i] + strs[j]) - widths[i] - widths[j];
 
-    switch (chunk.type)
-    {
-      case 0x54455341: // ASET
-      case 0x47415441: // ATAG
-      case 0x52444849: // IHDR
-      case 0x52444846: // FHDR
-      case 0x444e4541: // AEND
-        {
-          std::vector<char> buffer(chunk.length);
+      if (advance != 0)
+      {
+        pairs.push_back({ candidates[i], candidates[j], (int16_t)advance });
+      }
+    }
+  }
 
-          fin.read(buffer.data(), chunk.length);
+  return pairs;
+}
 
-          write_chunk(fout, (char*)&chunk.type, buffer.size(), buffer.data());
 
-          break;
-        }
+void add_font_asset(std::vector<BuildAsset> &assets, string const &fontname, uint32_t atlasid, int size, std::vector<pair<uint32_t, uint32_t>> const &ranges, std::vector<pair<uint32_t, uint32_t>> const &kernranges, std::vector<AssetTag> const &tags = {})
+{
+  auto asset = make_asset(static_cast<uint32_t>(AssetType::Font), tags);
 
-      default:
-        fin.seekg(chunk.length, ios::cur);
-    }
+  asset.name = fontname;
 
-    fin.seekg(sizeof(uint32_t), ios::cur);
-  }
+  asset.hash = fnv(fontname.c_str(), asset.hash);
+  asset.hash = fnv(&size, sizeof(size), asset.hash);
+  asset.hash = fnv(&atlasid, sizeof(atlasid), asset.hash);
+  asset.hash = fnv(ranges.data(), ranges.size() * sizeof(ranges[0]), asset.hash);
+  asset.hash = fnv(kernranges.data(), kernranges.size() * sizeof(kernranges[0]), asset.hash);
 
-  write_chunk(fout, "HEND", 0, nullptr);
+  asset.build = [=](BuildQueue &, BuildAsset &asset) {
 
-  // Second Pass, add compressed data
+    QFont font(fontname.c_str(), size);
 
-  fout.seekg(sizeof(PackHeader), ios::beg);
+    QFontMetrics tm(font);
 
-  while (fout)
-  {
-    PackChunk chunk;
+    int width, height;
 
-    fout.read((char*)&chunk, sizeof(chunk));
+    auto codepoints = glyph_codepoints(ranges);
 
-    if (chunk.type == 0x444e4548) // HEND
-      break;
+    auto glyphs = layout_glyphs(tm, codepoints, &width, &height);
 
-    auto position = fout.tellg();
+    auto kerning = kerning_pairs(tm, codepoints, kernranges);
 
-    switch (chunk.type)
-    {
-      case 0x52444849: // IHDR
-      case 0x52444846: // FHDR
-        {
-          uint64_t dataoffset;
+    size_t datasize = sizeof(PackFontPayload) + glyphs.size()*sizeof(PackGlyph) + kerning.size()*sizeof(PackKerning);
 
-          fout.seekg((size_t)position + chunk.length - sizeof(uint64_t), ios::beg);
-          fout.read((char*)&dataoffset, sizeof(dataoffset));
+    asset.header = 0x52444846; // FHDR
+    asset.fhdr = { (uint32_t)tm.ascent(), (uint32_t)tm.descent(), (uint32_t)tm.leading(), (uint32_t)datasize };
 
-          // write compressed dat
+    unique_ptr<char[]> data(new char[datasize]);
 
-          PackChunk dat;
+    PackFontPayload payload = { (uint32_t)glyphs.size(), (uint32_t)kerning.size(), atlasid };
 
-          fin.seekg(dataoffset);
+    memcpy(data.get(), &payload, sizeof(payload));
 
-          fin.read((char*)&dat, sizeof(dat));
+    memcpy(data.get() + sizeof(PackFontPayload), glyphs.data(), glyphs.size()*sizeof(PackGlyph));
 
-          std::vector<char> buffer(dat.length);
+    memcpy(data.get() + sizeof(PackFontPayload) + glyphs.size()*sizeof(PackGlyph), kerning.data(), kerning.size()*sizeof(PackKerning));
 
-          fin.read(buffer.data(), dat.length);
+    build_payload(asset, "FDAT", datasize, data.get());
+  };
 
-          fout.seekp(0, ios::end);
+  assets.push_back(std::move(asset));
 
-          dataoffset = fout.tellp();
+  auto atlas = make_asset(atlasid, {});
 
-          write_compressed_chunk(fout, (const char*)&dat.type, buffer.size(), buffer.data());
+  atlas.name = fontname + " atlas";
 
-          // rewrite hdr
+  atlas.hash = fnv(fontname.c_str(), atlas.hash);
+  atlas.hash = fnv(&size, sizeof(size), atlas.hash);
+  atlas.hash = fnv(ranges.data(), ranges.size() * sizeof(ranges[0]), atlas.hash);
 
-          fout.seekg((size_t)position + chunk.length - sizeof(uint64_t), ios::beg);
-          fout.write((char*)&dataoffset, sizeof(dataoffset));
-        }
-    }
+  atlas.build = [=](BuildQueue &, BuildAsset &asset) {
 
-    fout.seekg(position, ios::beg);
-    fout.seekg(chunk.length + sizeof(uint32_t), ios::cur);
-  }
+    QFont font(fontname.c_str(), size);
 
-  fin.close();
-  fout.close();
+    QFontMetrics tm(font);
 
-  QFile::remove(path);
-  QFile::rename("tmp.hha", path);
-}
+    int width, height;
 
+    auto codepoints = glyph_codepoints(ranges);
 
-void write_test1()
-{
-  ofstream fout("test1.hha", ios::binary | ios::trunc);
+    auto glyphs = layout_glyphs(tm, codepoints, &width, &height);
 
-  write_header(fout);
+    QImage image(width, height, QImage::Format_ARGB32_Premultiplied);
 
-  write_image_asset(fout, AssetType::HeroHead, "../../data/test/test_hero_front_head.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 0*PI/2 }, { AssetTagId::Orientation, 2*PI } });
-  write_image_asset(fout, AssetType::HeroHead, "../../data/test/test_hero_right_head.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 1*PI/2 } });
-  write_image_asset(fout, AssetType::HeroHead, "../../data/test/test_hero_back_head.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 2*PI/2 } });
-  write_image_asset(fout, AssetType::HeroHead, "../../data/test/test_hero_left_head.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 3*PI/2 } });
+    image.fill(0x00000000);
 
-  write_image_asset(fout, AssetType::HeroTorso, "../../data/test/test_hero_front_torso.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 0*PI/2 }, { AssetTagId::Orientation, 2*PI } });
-  write_image_asset(fout, AssetType::HeroTorso, "../../data/test/test_hero_right_torso.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 1*PI/2 } });
-  write_image_asset(fout, AssetType::HeroTorso, "../../data/test/test_hero_back_torso.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 2*PI/2 } });
-  write_image_asset(fout, AssetType::HeroTorso, "../../data/test/test_hero_left_torso.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 3*PI/2 } });
+    {
+      QPainter painter(&image);
 
-  write_image_asset(fout, AssetType::HeroCape, "../../data/test/test_hero_front_cape.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 0*PI/2 }, { AssetTagId::Orientation, 2*PI } });
-  write_image_asset(fout, AssetType::HeroCape, "../../data/test/test_hero_right_cape.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 1*PI/2 } });
-  write_image_asset(fout, AssetType::HeroCape, "../../data/test/test_hero_back_cape.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 2*PI/2 } });
-  write_image_asset(fout, AssetType::HeroCape, "../../data/test/test_hero_left_cape.bmp", 0.5, 0.5, { { AssetTagId::Orientation, 3*PI/2 } });
+      painter.setFont(font);
+      painter.setPen(Qt::white);
 
-  write_chunk(fout, "HEND", 0, nullptr);
+      for(auto &glyph : glyphs)
+      {
+        if (glyph.width != 0)
+        {
+          painter.drawText(QRect(glyph.x + 1, glyph.y + 1, glyph.width - 2, glyph.height - 2), glyph_string(glyph.codepoint));
+        }
+      }
+    }
 
-  fout.close();
+    // glyphs are white, so alpha alone carries the premultiplied texel
 
-  compress("test1.hha");
-}
+    image = image.convertToFormat(QImage::Format_Alpha8);
 
+    vector<uint8_t> bits(image.width() * image.height());
 
-void write_test2()
-{
-  ofstream fout("test2.hha", ios::binary | ios::trunc);
+    for(int y = 0; y < image.height(); ++y)
+    {
+      memcpy(bits.data() + y * image.width(), image.constScanLine(y), image.width());
+    }
 
-  write_header(fout);
+    asset.header = 0x52444849; // IHDR
+    asset.ihdr = { (uint32_t)image.width(), (uint32_t)image.height(), 0.0f, 0.0f };
+    asset.ihdr.format = static_cast<uint32_t>(PackImageFormat::A8);
 
-  write_image_asset(fout, AssetType::Tree, "../../data/test2/tree00.bmp", 0.5, 0.5);
-  write_image_asset(fout, AssetType::Tree, "../../data/test2/tree01.bmp", 0.5, 0.5);
-  write_image_asset(fout, AssetType::Tree, "../../data/test2/tree02.bmp", 0.5, 0.5);
+    build_payload(asset, "IDAT", bits.size(), bits.data());
+  };
 
-  write_chunk(fout, "HEND", 0, nullptr);
+  assets.push_back(std::move(atlas));
+}
 
-  fout.close();
 
-  compress("test2.hha");
+size_t chunk_size(size_t length)
+{
+  return sizeof(PackChunk) + length + sizeof(uint32_t);
 }
 
 
-void write_test3()
+size_t header_size(BuildAsset const &asset)
 {
-  ofstream fout("test3.hha", ios::binary | ios::trunc);
+  return (asset.header == 0x52444849) ? sizeof(asset.ihdr) : sizeof(asset.fhdr);
+}
 
-  write_header(fout);
 
-  write_font_asset(fout, "Arial", 0x10000);
+void write_metadata(ostream &fout, BuildAsset const &asset)
+{
+  PackAssetHeader aset = { asset.type };
 
-  write_chunk(fout, "HEND", 0, nullptr);
+  write_chunk(fout, "ASET", sizeof(aset), &aset);
 
-  fout.close();
+  for(auto &atag : asset.tags)
+  {
+    write_chunk(fout, "ATAG", sizeof(atag), &atag);
+  }
+
+  write_chunk(fout, (const char*)&asset.header, header_size(asset), &asset.ihdr);
 
-  compress("test3.hha");
+  write_chunk(fout, "AEND", 0, nullptr);
 }
 
 
-int main(int argc, char **argv)
+void write_pack(const char *path, std::vector<BuildAsset> &assets, std::vector<size_t> const &order)
 {
-  QGuiApplication app(argc, argv);
+  // lay out header, toc, metadata and then the payloads, so the file is written front to back
 
-  cout << "Asset Builder" << endl;
+  size_t tagcount = 0;
 
-  try
+  for(auto &asset : assets)
+    tagcount += asset.tags.size();
+
+  PackTocHeader toc = { (uint32_t)assets.size(), (uint32_t)tagcount };
+
+  std::vector<char> tocbuffer(sizeof(toc) + assets.size() * sizeof(PackTocEntry) + tagcount * sizeof(PackAssetTag));
+
+  uint64_t position = sizeof(PackHeader) + chunk_size(tocbuffer.size());
+
+  for(auto &asset : assets)
   {
-    write_test1();
-    write_test2();
-    write_test3();
+    position += chunk_size(sizeof(PackAssetHeader)) + asset.tags.size() * chunk_size(sizeof(PackAssetTag)) + chunk_size(header_size(asset)) + chunk_size(0);
+  }
+
+  position += chunk_size(0);
+
+  auto entries = reinterpret_cast<PackTocEntry*>(tocbuffer.data() + sizeof(toc));
+  auto tags = reinterpret_cast<PackAssetTag*>(tocbuffer.data() + sizeof(toc) + assets.size() * sizeof(PackTocEntry));
+
+  memcpy(tocbuffer.data(), &toc, sizeof(toc));
+
+  // payloads are placed in the requested order, metadata stays in declaration order,
+  // identical payloads are stored once and share a data chunk, compared byte for byte
+
+  std::vector<size_t> payloads;
+
+  auto stored = [](BuildAsset const &asset) {
+    if (asset.header == 0x52444849) // IHDR
+      return make_tuple(asset.ihdr.datahash, asset.checksum, asset.ihdr.packedsize, asset.ihdr.codec, asset.ihdr.format);
+    else
+      return make_tuple(asset.fhdr.datahash, asset.checksum, asset.fhdr.packedsize, asset.fhdr.codec, uint32_t(0));
+  };
+
+  std::multimap<decltype(stored(assets[0])), std::pair<size_t, uint64_t>> written;
+
+  for(auto i : order)
+  {
+    auto &asset = assets[i];
+
+    auto key = stored(asset);
+
+    auto range = written.equal_range(key);
+
+    auto j = find_if(range.first, range.second, [&](decltype(*range.first) &entry) { return assets[entry.second.first].payload == asset.payload; });
+
+    if (j == range.second)
+    {
+      j = written.emplace(key, make_pair(i, position));
+
+      payloads.push_back(i);
+
+      position += chunk_size(asset.payload.size());
+    }
+
+    if (asset.header == 0x52444849) // IHDR
+      asset.ihdr.dataoffset = j->second.second;
+
+    if (asset.header == 0x52444846) // FHDR
+      asset.fhdr.dataoffset = j->second.second;
+  }
+
+  for(size_t i = 0, tagindex = 0; i < assets.size(); ++i)
+  {
+    auto &asset = assets[i];
+
+    entries[i] = { asset.type, (uint32_t)tagindex, (uint32_t)asset.tags.size(), asset.header };
+
+    memcpy(&entries[i].ihdr, &asset.ihdr, header_size(asset));
+
+    tagindex = copy(asset.tags.begin(), asset.tags.end(), tags + tagindex) - tags;
+  }
+
+  // single sequential write
+
+  std::vector<char> iobuffer(1024*1024);
+
+  ofstream fout;
+
+  fout.rdbuf()->pubsetbuf(iobuffer.data(), iobuffer.size());
+
+  fout.open(path, ios::binary | ios::trunc);
+
+  write_header(fout);
+
+  write_chunk(fout, "ATOC", tocbuffer.size(), tocbuffer.data());
+
+  for(auto &asset : assets)
+  {
+    write_metadata(fout, asset);
+  }
+
+  write_chunk(fout, "HEND", 0, nullptr);
+
+  for(auto i : payloads)
+  {
+    write_chunk(fout, (const char*)&assets[i].datatype, assets[i].payload.size(), assets[i].payload.data(), assets[i].checksum);
+  }
+
+  fout.close();
+
+  if (!fout)
+    throw runtime_error(string("Error writing ") + path);
+}
+
+
+#pragma pack(push, 1)
+
+struct BuildManifestHeader
+{
+  uint8_t signature[8];
+  uint32_t version;
+  uint32_t assetcount;
+  uint64_t packsize;
+  uint32_t packhash;
+  uint64_t layouthash;
+  // uint64_t hashes[assetcount];
+};
+
+#pragma pack(pop)
+
+const BuildManifestHeader BuildManifestSignature = { { 0xCA, 'H', 'H', 'M', 0x0D, 0x0A, 0x1A, 0x0A }, BuildVersion };
+
+
+void hash_sources(BuildAsset &asset)
+{
+  for(auto &source : asset.sources)
+  {
+    ifstream fin(source, ios::binary);
+
+    vector<char> buffer((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+
+    asset.hash = fnv(buffer.data(), buffer.size(), fnv(source.c_str(), asset.hash));
+  }
+}
+
+
+bool read_pack_key(const char *path, uint64_t *size, uint32_t *hash)
+{
+  ifstream fin(path, ios::binary | ios::ate);
+
+  if (!fin)
+    return false;
+
+  *size = fin.tellg();
+
+  // keyed by the checksum of the toc chunk, as the runtime asset cache is
+
+  PackChunk chunk;
+
+  fin.seekg(sizeof(PackHeader), ios::beg);
+  fin.read((char*)&chunk, sizeof(chunk));
+
+  if (!fin || chunk.type != 0x434f5441) // ATOC
+    return false;
+
+  fin.seekg(chunk.length, ios::cur);
+  fin.read((char*)hash, sizeof(*hash));
+
+  return (bool)fin;
+}
+
+
+vector<uint64_t> read_manifest(const char *path, uint64_t *layouthash)
+{
+  vector<uint64_t> hashes;
+
+  ifstream fin(string(path) + ".manifest", ios::binary);
+
+  BuildManifestHeader header;
+
+  if (!fin.read((char*)&header, sizeof(header)))
+    return hashes;
+
+  if (memcmp(&header, &BuildManifestSignature, sizeof(header.signature) + sizeof(header.version)) != 0)
+    return hashes;
+
+  // the manifest describes the pack it was written with, or nothing
+
+  uint64_t packsize;
+  uint32_t packhash;
+
+  if (!read_pack_key(path, &packsize, &packhash) || packsize != header.packsize || packhash != header.packhash)
+    return hashes;
+
+  *layouthash = header.layouthash;
+
+  hashes.resize(header.assetcount);
+
+  if (!fin.read((char*)hashes.data(), hashes.size() * sizeof(uint64_t)))
+    hashes.clear();
+
+  return hashes;
+}
+
+
+void write_manifest(const char *path, std::vector<BuildAsset> const &assets, uint64_t layouthash)
+{
+  BuildManifestHeader header = BuildManifestSignature;
+
+  header.assetcount = assets.size();
+  header.layouthash = layouthash;
+
+  if (!read_pack_key(path, &header.packsize, &header.packhash))
+    return;
+
+  ofstream fout(string(path) + ".manifest", ios::binary | ios::trunc);
+
+  fout.write((char*)&header, sizeof(header));
+
+  for(auto &asset : assets)
+  {
+    fout.write((char*)&asset.hash, sizeof(asset.hash));
+  }
+}
+
+
+void read_packed_asset(const char *path, size_t index, BuildAsset &asset)
+{
+  ifstream fin(path, ios::binary);
+
+  PackChunk chunk;
+
+  fin.seekg(sizeof(PackHeader), ios::beg);
+  fin.read((char*)&chunk, sizeof(chunk));
+
+  PackTocHeader toc;
+
+  fin.read((char*)&toc, sizeof(toc));
+
+  if (!fin || chunk.type != 0x434f5441 || index >= toc.assetcount) // ATOC
+    throw runtime_error("Invalid pack on splice");
+
+  PackTocEntry entry;
+
+  fin.seekg(index * sizeof(PackTocEntry), ios::cur);
+  fin.read((char*)&entry, sizeof(entry));
+
+  asset.header = entry.header;
+
+  if (entry.header == 0x52444849) // IHDR
+    asset.ihdr = entry.ihdr;
+
+  if (entry.header == 0x52444846) // FHDR
+    asset.fhdr = entry.fhdr;
+
+  PackChunk dat;
+
+  fin.seekg((entry.header == 0x52444849) ? entry.ihdr.dataoffset : entry.fhdr.dataoffset, ios::beg);
+  fin.read((char*)&dat, sizeof(dat));
+
+  asset.datatype = dat.type;
+  asset.payload.resize(dat.length);
+
+  fin.read(asset.payload.data(), asset.payload.size());
+  fin.read((char*)&asset.checksum, sizeof(asset.checksum));
+
+  if (!fin)
+    throw runtime_error("Invalid pack on splice");
+}
+
+
+struct BuildTrace
+{
+  uint64_t hash = 0;
+
+  // payload (checksum, size) to order of first use
+  std::unordered_map<uint64_t, size_t> ranks;
+};
+
+
+uint64_t trace_key(uint32_t checksum, uint32_t packedsize)
+{
+  return (uint64_t)checksum << 32 | packedsize;
+}
+
+
+BuildTrace read_trace(const char *path)
+{
+  BuildTrace trace;
+
+  ifstream fin(path, ios::binary);
+
+  PackTraceHeader header;
+
+  if (!fin.read((char*)&header, sizeof(header)) || memcmp(header.signature, "\xCAHHT\r\n\x1A\n", sizeof(header.signature)) != 0 || header.version != 1)
+    throw runtime_error(string("Invalid trace file ") + path);
+
+  trace.hash = fnv(&header, sizeof(header));
+
+  PackTraceEntry entry;
+
+  while (fin.read((char*)&entry, sizeof(entry)))
+  {
+    trace.hash = fnv(&entry, sizeof(entry), trace.hash);
+
+    trace.ranks.emplace(trace_key(entry.checksum, entry.packedsize), trace.ranks.size());
+  }
+
+  return trace;
+}
+
+
+vector<size_t> payload_order(std::vector<BuildAsset> const &assets, BuildTrace const &trace)
+{
+  // traced payloads first by first use, so assets first used in the same frame sit together,
+  // then the rest in declaration order
+
+  vector<size_t> order(assets.size());
+
+  iota(order.begin(), order.end(), 0);
+
+  auto rank = [&](size_t i) {
+    auto j = trace.ranks.find(trace_key(assets[i].checksum, assets[i].payload.size()));
+    return (j != trace.ranks.end()) ? j->second : trace.ranks.size();
+  };
+
+  stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return rank(lhs) < rank(rhs); });
+
+  return order;
+}
+
+
+void build_pack(BuildQueue &queue, const char *path, std::vector<BuildAsset> &assets, BuildTrace const &trace)
+{
+  BuildQueue::Group group;
+
+  for(auto &asset : assets)
+  {
+    queue.submit(group, [&asset]() { hash_sources(asset); });
+  }
+
+  queue.wait(group);
+
+  // chained assets are built from their first asset's sources
+
+  for(size_t i = 0; i < assets.size(); i += 1 + assets[i].chained)
+  {
+    for(size_t k = 1; k <= assets[i].chained; ++k)
+      assets[i + k].hash = fnv(&assets[i].hash, sizeof(assets[i].hash), assets[i + k].hash);
+  }
+
+  // compare against the previous build
+
+  uint64_t layouthash = 0;
+
+  auto previous = read_manifest(path, &layouthash);
+
+  std::unordered_map<uint64_t, size_t> reusable;
+
+  for(size_t i = 0; i < previous.size(); ++i)
+  {
+    reusable.emplace(previous[i], i);
+  }
+
+  if (layouthash == trace.hash && previous.size() == assets.size() && equal(assets.begin(), assets.end(), previous.begin(), [](auto &lhs, auto &rhs) { return lhs.hash == rhs; }))
+  {
+    cout << "  " << path << " (up to date)" << endl;
+
+    return;
+  }
+
+  // load, convert and compress on the queue, unchanged assets are spliced from the previous pack
+
+  std::vector<char> rebuilt(assets.size(), true);
+
+  for(size_t i = 0; i < assets.size(); i += 1 + assets[i].chained)
+  {
+    auto &asset = assets[i];
+
+    // a chain is spliced whole or built whole
+
+    auto first = assets.begin() + i;
+    auto last = first + 1 + asset.chained;
+
+    if (all_of(first, last, [&](BuildAsset const &link) { return reusable.count(link.hash) != 0; }))
+    {
+      for(auto k = i; k < i + 1 + asset.chained; ++k)
+      {
+        auto j = reusable.find(assets[k].hash);
+
+        rebuilt[k] = false;
+
+        queue.submit(group, [=, &assets]() { read_packed_asset(path, j->second, assets[k]); });
+      }
+    }
+    else
+    {
+      queue.submit(group, [&queue, &asset]() { asset.build(queue, asset); });
+    }
+  }
+
+  queue.wait(group);
+
+  // write in declaration order
+
+  write_pack(path, assets, payload_order(assets, trace));
+
+  write_manifest(path, assets, trace.hash);
+
+  for(size_t i = 0; i < assets.size(); ++i)
+  {
+    if (rebuilt[i] && !assets[i].name.empty())
+      cout << "  " << assets[i].name << endl;
+  }
+
+  if (find(rebuilt.begin(), rebuilt.end(), true) == rebuilt.end())
+  {
+    cout << "  " << path << " (relaid)" << endl;
+  }
+}
+
+
+//|---------------------- BuildManifest -------------------------------------
+//|--------------------------------------------------------------------------
+
+struct BuildPack
+{
+  string path;
+
+  vector<BuildAsset> assets;
+};
+
+
+vector<string> tokenise(string const &line)
+{
+  vector<string> tokens;
+
+  for(size_t i = 0; i < line.size(); )
+  {
+    if (isspace((unsigned char)line[i]))
+    {
+      ++i;
+      continue;
+    }
+
+    if (line[i] == '#')
+      break;
+
+    if (line[i] == '"')
+    {
+      auto j = line.find('"', i + 1);
+
+      if (j == string::npos)
+        throw runtime_error("unterminated string");
+
+      tokens.push_back(line.substr(i + 1, j - i - 1));
+
+      i = j + 1;
+    }
+    else
+    {
+      auto j = i;
+
+      while (j < line.size() && !isspace((unsigned char)line[j]) && line[j] != '#')
+        ++j;
+
+      tokens.push_back(line.substr(i, j - i));
+
+      i = j;
+    }
+  }
+
+  return tokens;
+}
+
+
+float parse_value(string const &token)
+{
+  // plain number, or a multiple of pi as in 3pi/2
+
+  char *end;
+
+  float value = strtof(token.c_str(), &end);
+
+  if (strncmp(end, "pi", 2) == 0)
+  {
+    value = (end == token.c_str()) ? PI : value * PI;
+
+    end += 2;
+  }
+  else if (end == token.c_str())
+    throw runtime_error("invalid value '" + token + "'");
+
+  if (*end == '/')
+  {
+    value = value / strtof(end + 1, &end);
+  }
+
+  if (*end != 0)
+    throw runtime_error("invalid value '" + token + "'");
+
+  return value;
+}
+
+
+uint32_t parse_integer(string const &token)
+{
+  char *end;
+
+  auto value = strtoul(token.c_str(), &end, 0);
+
+  if (end == token.c_str() || *end != 0)
+    throw runtime_error("invalid integer '" + token + "'");
+
+  return value;
+}
+
+
+AssetType parse_asset_type(string const &token)
+{
+  static const pair<const char *, AssetType> types[] =
+  {
+    { "HeroHead", AssetType::HeroHead },
+    { "HeroTorso", AssetType::HeroTorso },
+    { "HeroCape", AssetType::HeroCape },
+    { "Tree", AssetType::Tree },
+    { "Font", AssetType::Font },
+  };
+
+  for(auto &type : types)
+  {
+    if (token == type.first)
+      return type.second;
+  }
+
+  throw runtime_error("unknown asset type '" + token + "'");
+}
+
+
+PackImageFormat parse_image_format(string const &token)
+{
+  static const pair<const char *, PackImageFormat> formats[] =
+  {
+    { "BGRA", PackImageFormat::BGRA },
+    { "BC1", PackImageFormat::BC1 },
+    { "BC3", PackImageFormat::BC3 },
+    { "BC7", PackImageFormat::BC7 },
+  };
+
+  for(auto &format : formats)
+  {
+    if (token == format.first)
+      return format.second;
+  }
+
+  throw runtime_error("unknown image format '" + token + "'");
+}
+
+
+AssetTagId parse_tag_id(string const &token)
+{
+  static const pair<const char *, AssetTagId> ids[] =
+  {
+    { "Orientation", AssetTagId::Orientation },
+  };
+
+  for(auto &id : ids)
+  {
+    if (token == id.first)
+      return id.second;
+  }
+
+  throw runtime_error("unknown asset tag '" + token + "'");
+}
+
+
+// pack <file>
+// image <type> <path> [align <x> <y>] [format <BGRA|BC1|BC3|BC7>] [tag <id> <value>]...
+// font <family> <atlasid> [size <points>] [range <first> <last>]... [kerning <first> <last>]... [tag <id> <value>]...
+//
+// source paths are relative to the manifest, packs are written to the working directory
+
+vector<BuildPack> read_build_manifest(const char *path)
+{
+  ifstream fin(path);
+
+  if (!fin)
+    throw runtime_error(string("unable to open build manifest ") + path);
+
+  string base = path;
+
+  base = base.substr(0, base.find_last_of("/\\") + 1);
+
+  vector<BuildPack> packs;
+
+  string line;
+
+  for(int lineno = 1; getline(fin, line); ++lineno)
+  {
+    try
+    {
+      auto tokens = tokenise(line);
+
+      if (tokens.empty())
+        continue;
+
+      auto &directive = tokens[0];
+
+      if (directive == "pack")
+      {
+        if (tokens.size() != 2)
+          throw runtime_error("expected pack <file>");
+
+        packs.push_back({ tokens[1] });
+
+        continue;
+      }
+
+      if (directive != "image" && directive != "font")
+        throw runtime_error("unknown directive '" + directive + "'");
+
+      if (packs.empty())
+        throw runtime_error("asset outside of a pack");
+
+      if (tokens.size() < 3)
+        throw runtime_error("expected " + directive + " <type> <path>");
+
+      float alignx = 0.5f;
+      float aligny = 0.5f;
+      int size = 48;
+
+      auto format = PackImageFormat::BGRA;
+
+      std::vector<pair<uint32_t, uint32_t>> ranges;
+      std::vector<pair<uint32_t, uint32_t>> kernranges;
+
+      std::vector<AssetTag> tags;
+
+      for(size_t i = 3; i < tokens.size(); ++i)
+      {
+        if (tokens[i] == "align" && i + 2 < tokens.size())
+        {
+          alignx = parse_value(tokens[i+1]);
+          aligny = parse_value(tokens[i+2]);
+
+          i += 2;
+        }
+        else if (tokens[i] == "format" && i + 1 < tokens.size())
+        {
+          format = parse_image_format(tokens[i+1]);
+
+          i += 1;
+        }
+        else if (tokens[i] == "size" && i + 1 < tokens.size())
+        {
+          size = parse_integer(tokens[i+1]);
+
+          i += 1;
+        }
+        else if (tokens[i] == "range" && i + 2 < tokens.size())
+        {
+          ranges.push_back({ parse_integer(tokens[i+1]), parse_integer(tokens[i+2]) });
+
+          if (ranges.back().first > ranges.back().second || ranges.back().second > 0x10FFFF)
+            throw runtime_error("invalid range '" + tokens[i+1] + " " + tokens[i+2] + "'");
+
+          i += 2;
+        }
+        else if (tokens[i] == "kerning" && i + 2 < tokens.size())
+        {
+          kernranges.push_back({ parse_integer(tokens[i+1]), parse_integer(tokens[i+2]) });
+
+          if (kernranges.back().first > kernranges.back().second || kernranges.back().second > 0x10FFFF)
+            throw runtime_error("invalid kerning range '" + tokens[i+1] + " " + tokens[i+2] + "'");
+
+          i += 2;
+        }
+        else if (tokens[i] == "tag" && i + 2 < tokens.size())
+        {
+          tags.push_back({ parse_tag_id(tokens[i+1]), parse_value(tokens[i+2]) });
+
+          i += 2;
+        }
+        else
+          throw runtime_error("unexpected '" + tokens[i] + "'");
+      }
+
+      if (directive == "image")
+        add_image_asset(packs.back().assets, parse_asset_type(tokens[1]), base + tokens[2], alignx, aligny, format, tags);
+
+      if (directive == "font")
+      {
+        if (ranges.empty())
+          ranges.push_back({ 32, 126 });
+
+        if (kernranges.empty())
+          kernranges.push_back({ 32, 126 });
+
+        add_font_asset(packs.back().assets, tokens[1], parse_integer(tokens[2]), size, ranges, kernranges, tags);
+      }
+    }
+    catch(std::exception &e)
+    {
+      throw runtime_error(string(path) + "(" + to_string(lineno) + "): " + e.what());
+    }
+  }
+
+  return packs;
+}
+
+
+int main(int argc, char **argv)
+{
+  QGuiApplication app(argc, argv);
+
+  cout << "Asset Builder" << endl;
+
+  try
+  {
+    const char *manifest = "../../data/assetpacks.txt";
+
+    BuildTrace trace;
+
+    for(int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        trace = read_trace(argv[++i]);
+      else
+        manifest = argv[i];
+    }
+
+    auto packs = read_build_manifest(manifest);
+
+    BuildQueue queue(max(thread::hardware_concurrency(), 1u));
+
+    // one job per pack, each fanning out one job per asset
+
+    BuildQueue::Group group;
+
+    for(auto &pack : packs)
+    {
+      queue.submit(group, [&]() { build_pack(queue, pack.path.c_str(), pack.assets, trace); });
+    }
+
+    queue.wait(group);
   }
   catch(std::exception &e)
   {
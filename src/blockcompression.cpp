@@ -0,0 +1,786 @@
+//
+// Handmade Hero - block compression
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#include "blockcompression.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+
+namespace
+{
+  const int BC7Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+  ///////////////////////// block_size ////////////////////////////////////////
+  size_t block_size(BlockFormat format)
+  {
+    return (format == BlockFormat::BC1) ? 8 : 16;
+  }
+
+
+  ///////////////////////// load_block ////////////////////////////////////////
+  void load_block(uint8_t const *bgra, int width, int height, int bx, int by, uint8_t rgba[16][4])
+  {
+    // texels beyond the image edge replicate the last row and column
+
+    for(int j = 0; j < 4; ++j)
+    {
+      for(int i = 0; i < 4; ++i)
+      {
+        int x = min(4*bx + i, width - 1);
+        int y = min(4*by + j, height - 1);
+
+        auto texel = bgra + 4*(y*width + x);
+
+        rgba[4*j + i][0] = texel[2];
+        rgba[4*j + i][1] = texel[1];
+        rgba[4*j + i][2] = texel[0];
+        rgba[4*j + i][3] = texel[3];
+      }
+    }
+  }
+
+
+  ///////////////////////// store_block ///////////////////////////////////////
+  void store_block(uint8_t const rgba[16][4], int width, int height, int bx, int by, uint8_t *bgra)
+  {
+    for(int j = 0; j < 4 && 4*by + j < height; ++j)
+    {
+      for(int i = 0; i < 4 && 4*bx + i < width; ++i)
+      {
+        auto texel = bgra + 4*((4*by + j)*width + 4*bx + i);
+
+        texel[0] = rgba[4*j + i][2];
+        texel[1] = rgba[4*j + i][1];
+        texel[2] = rgba[4*j + i][0];
+        texel[3] = rgba[4*j + i][3];
+      }
+    }
+  }
+
+
+  ///////////////////////// principal_axis ////////////////////////////////////
+  template<int N>
+  void principal_axis(uint8_t const rgba[16][4], bool const *mask, float mean[N], float axis[N])
+  {
+    // mean and dominant eigenvector of the covariance, by power iteration
+
+    int count = 0;
+
+    fill_n(mean, N, 0.0f);
+
+    for(int k = 0; k < 16; ++k)
+    {
+      if (mask && !mask[k])
+        continue;
+
+      for(int c = 0; c < N; ++c)
+        mean[c] += rgba[k][c];
+
+      count += 1;
+    }
+
+    for(int c = 0; c < N; ++c)
+      mean[c] /= max(count, 1);
+
+    float covariance[N][N] = {};
+
+    for(int k = 0; k < 16; ++k)
+    {
+      if (mask && !mask[k])
+        continue;
+
+      for(int a = 0; a < N; ++a)
+        for(int b = 0; b < N; ++b)
+          covariance[a][b] += (rgba[k][a] - mean[a]) * (rgba[k][b] - mean[b]);
+    }
+
+    fill_n(axis, N, 1.0f);
+
+    for(int iteration = 0; iteration < 8; ++iteration)
+    {
+      float next[N] = {};
+      float scale = 0.0f;
+
+      for(int a = 0; a < N; ++a)
+      {
+        for(int b = 0; b < N; ++b)
+          next[a] += covariance[a][b] * axis[b];
+
+        scale = max(scale, fabs(next[a]));
+      }
+
+      if (scale == 0.0f)
+        break;
+
+      for(int a = 0; a < N; ++a)
+        axis[a] = next[a] / scale;
+    }
+
+    float length = 0.0f;
+
+    for(int c = 0; c < N; ++c)
+      length += axis[c] * axis[c];
+
+    for(int c = 0; c < N; ++c)
+      axis[c] /= sqrt(length);
+  }
+
+
+  ///////////////////////// project_extents ///////////////////////////////////
+  template<int N>
+  void project_extents(uint8_t const rgba[16][4], bool const *mask, float const mean[N], float const axis[N], float lo[N], float hi[N])
+  {
+    float tmin = FLT_MAX;
+    float tmax = -FLT_MAX;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      if (mask && !mask[k])
+        continue;
+
+      float t = 0.0f;
+
+      for(int c = 0; c < N; ++c)
+        t += (rgba[k][c] - mean[c]) * axis[c];
+
+      tmin = min(tmin, t);
+      tmax = max(tmax, t);
+    }
+
+    for(int c = 0; c < N; ++c)
+    {
+      lo[c] = mean[c] + tmin * axis[c];
+      hi[c] = mean[c] + tmax * axis[c];
+    }
+  }
+
+
+  ///////////////////////// nearest ///////////////////////////////////////////
+  template<int N>
+  int nearest(uint8_t const texel[4], int const (*palette)[4], int count)
+  {
+    int best = 0;
+    int besterror = INT32_MAX;
+
+    for(int i = 0; i < count; ++i)
+    {
+      int error = 0;
+
+      for(int c = 0; c < N; ++c)
+        error += (texel[c] - palette[i][c]) * (texel[c] - palette[i][c]);
+
+      if (error < besterror)
+      {
+        best = i;
+        besterror = error;
+      }
+    }
+
+    return best;
+  }
+
+
+  ///////////////////////// refine_endpoints //////////////////////////////////
+  template<int N>
+  bool refine_endpoints(uint8_t const rgba[16][4], bool const *mask, int const indices[16], float const weights[], float extents[2][N])
+  {
+    // least squares endpoints for the chosen indices
+
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    float ax[N] = {}, bx[N] = {};
+
+    for(int k = 0; k < 16; ++k)
+    {
+      if (mask && !mask[k])
+        continue;
+
+      float t = weights[indices[k]];
+
+      aa += (1 - t) * (1 - t);
+      ab += (1 - t) * t;
+      bb += t * t;
+
+      for(int c = 0; c < N; ++c)
+      {
+        ax[c] += (1 - t) * rgba[k][c];
+        bx[c] += t * rgba[k][c];
+      }
+    }
+
+    float det = aa * bb - ab * ab;
+
+    if (fabs(det) < 1e-6f)
+      return false;
+
+    for(int c = 0; c < N; ++c)
+    {
+      extents[0][c] = (bb * ax[c] - ab * bx[c]) / det;
+      extents[1][c] = (aa * bx[c] - ab * ax[c]) / det;
+    }
+
+    return true;
+  }
+
+
+  ///////////////////////// pack565 ///////////////////////////////////////////
+  uint16_t pack565(float const rgb[3])
+  {
+    int r = (int)lround(min(max(rgb[0], 0.0f), 255.0f) * 31 / 255);
+    int g = (int)lround(min(max(rgb[1], 0.0f), 255.0f) * 63 / 255);
+    int b = (int)lround(min(max(rgb[2], 0.0f), 255.0f) * 31 / 255);
+
+    return (r << 11) | (g << 5) | b;
+  }
+
+
+  ///////////////////////// unpack565 /////////////////////////////////////////
+  void unpack565(uint16_t color, int rgb[4])
+  {
+    int r = (color >> 11) & 31;
+    int g = (color >> 5) & 63;
+    int b = color & 31;
+
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+    rgb[3] = 255;
+  }
+
+
+  ///////////////////////// color_palette /////////////////////////////////////
+  void color_palette(uint16_t c0, uint16_t c1, bool fourcolor, int palette[4][4])
+  {
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+
+    for(int c = 0; c < 3; ++c)
+    {
+      if (fourcolor)
+      {
+        palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+      }
+      else
+      {
+        palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+        palette[3][c] = 0;
+      }
+    }
+
+    palette[2][3] = 255;
+    palette[3][3] = fourcolor ? 255 : 0;
+  }
+
+
+  ///////////////////////// fit_color /////////////////////////////////////////
+  int fit_color(uint8_t const rgba[16][4], bool const opaque[16], bool transparent, bool alwaysfour, float const extents[2][3], uint16_t &c0, uint16_t &c1, int indices[16])
+  {
+    c0 = pack565(extents[0]);
+    c1 = pack565(extents[1]);
+
+    // c0 > c1 selects four colours, otherwise three and transparent black
+
+    if (transparent ? (c0 > c1) : (c0 < c1))
+      swap(c0, c1);
+
+    bool fourcolor = alwaysfour || c0 > c1;
+
+    int palette[4][4];
+
+    color_palette(c0, c1, fourcolor, palette);
+
+    int error = 0;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      indices[k] = 3;
+
+      if (opaque[k])
+      {
+        indices[k] = nearest<3>(rgba[k], palette, fourcolor ? 4 : 3);
+
+        for(int c = 0; c < 3; ++c)
+          error += (rgba[k][c] - palette[indices[k]][c]) * (rgba[k][c] - palette[indices[k]][c]);
+      }
+    }
+
+    return error;
+  }
+
+
+  ///////////////////////// encode_color //////////////////////////////////////
+  void encode_color(uint8_t const rgba[16][4], bool punchthrough, bool alwaysfour, uint8_t *dst)
+  {
+    bool opaque[16];
+
+    int count = 0;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      opaque[k] = !punchthrough || rgba[k][3] >= 128;
+
+      count += opaque[k];
+    }
+
+    bool transparent = (count != 16);
+
+    float extents[2][3] = {};
+
+    if (count != 0)
+    {
+      float mean[3], axis[3];
+
+      principal_axis<3>(rgba, opaque, mean, axis);
+
+      project_extents<3>(rgba, opaque, mean, axis, extents[1], extents[0]);
+    }
+
+    uint16_t c0, c1;
+    int indices[16];
+
+    int error = fit_color(rgba, opaque, transparent, alwaysfour, extents, c0, c1, indices);
+
+    for(int iteration = 0; iteration < 2 && error != 0; ++iteration)
+    {
+      static const float fourweights[4] = { 0.0f, 1.0f, 1/3.0f, 2/3.0f };
+      static const float threeweights[4] = { 0.0f, 1.0f, 1/2.0f, 0.0f };
+
+      uint16_t trialc0, trialc1;
+      int trialindices[16];
+
+      if (!refine_endpoints<3>(rgba, opaque, indices, (alwaysfour || c0 > c1) ? fourweights : threeweights, extents))
+        break;
+
+      int trialerror = fit_color(rgba, opaque, transparent, alwaysfour, extents, trialc0, trialc1, trialindices);
+
+      if (trialerror >= error)
+        break;
+
+      error = trialerror;
+
+      c0 = trialc0;
+      c1 = trialc1;
+
+      memcpy(indices, trialindices, sizeof(indices));
+    }
+
+    uint32_t bits = 0;
+
+    for(int k = 0; k < 16; ++k)
+      bits |= indices[k] << (2*k);
+
+    dst[0] = c0 & 0xFF;
+    dst[1] = c0 >> 8;
+    dst[2] = c1 & 0xFF;
+    dst[3] = c1 >> 8;
+
+    for(int i = 0; i < 4; ++i)
+      dst[4 + i] = (bits >> (8*i)) & 0xFF;
+  }
+
+
+  ///////////////////////// decode_color //////////////////////////////////////
+  void decode_color(uint8_t const *src, bool alwaysfour, uint8_t rgba[16][4])
+  {
+    uint16_t c0 = src[0] | (src[1] << 8);
+    uint16_t c1 = src[2] | (src[3] << 8);
+
+    int palette[4][4];
+
+    color_palette(c0, c1, alwaysfour || c0 > c1, palette);
+
+    for(int k = 0; k < 16; ++k)
+    {
+      int index = (src[4 + k/4] >> (2*(k%4))) & 3;
+
+      for(int c = 0; c < 4; ++c)
+        rgba[k][c] = palette[index][c];
+    }
+  }
+
+
+  ///////////////////////// alpha_palette /////////////////////////////////////
+  void alpha_palette(int a0, int a1, int palette[8])
+  {
+    palette[0] = a0;
+    palette[1] = a1;
+
+    if (a0 > a1)
+    {
+      for(int i = 1; i < 7; ++i)
+        palette[i+1] = ((7 - i)*a0 + i*a1) / 7;
+    }
+    else
+    {
+      for(int i = 1; i < 5; ++i)
+        palette[i+1] = ((5 - i)*a0 + i*a1) / 5;
+
+      palette[6] = 0;
+      palette[7] = 255;
+    }
+  }
+
+
+  ///////////////////////// encode_alpha //////////////////////////////////////
+  void encode_alpha(uint8_t const rgba[16][4], uint8_t *dst)
+  {
+    int a0 = 0;
+    int a1 = 255;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      a0 = max(a0, (int)rgba[k][3]);
+      a1 = min(a1, (int)rgba[k][3]);
+    }
+
+    int palette[8];
+
+    alpha_palette(a0, a1, palette);
+
+    uint64_t indices = 0;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      int best = 0;
+
+      for(int i = 1; i < 8; ++i)
+      {
+        if (abs(rgba[k][3] - palette[i]) < abs(rgba[k][3] - palette[best]))
+          best = i;
+      }
+
+      indices |= uint64_t(best) << (3*k);
+    }
+
+    dst[0] = a0;
+    dst[1] = a1;
+
+    for(int i = 0; i < 6; ++i)
+      dst[2 + i] = (indices >> (8*i)) & 0xFF;
+  }
+
+
+  ///////////////////////// decode_alpha //////////////////////////////////////
+  void decode_alpha(uint8_t const *src, uint8_t rgba[16][4])
+  {
+    int palette[8];
+
+    alpha_palette(src[0], src[1], palette);
+
+    uint64_t indices = 0;
+
+    for(int i = 0; i < 6; ++i)
+      indices |= uint64_t(src[2 + i]) << (8*i);
+
+    for(int k = 0; k < 16; ++k)
+      rgba[k][3] = palette[(indices >> (3*k)) & 7];
+  }
+
+
+  ///////////////////////// write_bits ////////////////////////////////////////
+  void write_bits(uint8_t *block, int &position, uint32_t value, int bits)
+  {
+    for(int i = 0; i < bits; ++i, ++position)
+    {
+      if ((value >> i) & 1)
+        block[position >> 3] |= 1 << (position & 7);
+    }
+  }
+
+
+  ///////////////////////// read_bits /////////////////////////////////////////
+  uint32_t read_bits(uint8_t const *block, int &position, int bits)
+  {
+    uint32_t value = 0;
+
+    for(int i = 0; i < bits; ++i, ++position)
+    {
+      value |= ((block[position >> 3] >> (position & 7)) & 1) << i;
+    }
+
+    return value;
+  }
+
+
+  ///////////////////////// bc7_palette ///////////////////////////////////////
+  void bc7_palette(int const endpoints[2][4], int palette[16][4])
+  {
+    for(int i = 0; i < 16; ++i)
+    {
+      for(int c = 0; c < 4; ++c)
+        palette[i][c] = ((64 - BC7Weights[i])*endpoints[0][c] + BC7Weights[i]*endpoints[1][c] + 32) >> 6;
+    }
+  }
+
+
+  ///////////////////////// fit_bc7 ///////////////////////////////////////////
+  int fit_bc7(uint8_t const rgba[16][4], float const extents[2][4], int quantised[2][4], int pbits[2], int indices[16])
+  {
+    int endpoints[2][4];
+
+    for(int n = 0; n < 2; ++n)
+    {
+      float besterror = FLT_MAX;
+
+      for(int pbit = 0; pbit < 2; ++pbit)
+      {
+        int values[4];
+        float error = 0.0f;
+
+        for(int c = 0; c < 4; ++c)
+        {
+          values[c] = (int)min(max(lround((extents[n][c] - pbit) / 2), 0l), 127l);
+
+          error += (2*values[c] + pbit - extents[n][c]) * (2*values[c] + pbit - extents[n][c]);
+        }
+
+        if (error < besterror)
+        {
+          besterror = error;
+
+          copy(values, values + 4, quantised[n]);
+
+          pbits[n] = pbit;
+        }
+      }
+
+      for(int c = 0; c < 4; ++c)
+        endpoints[n][c] = 2*quantised[n][c] + pbits[n];
+    }
+
+    int palette[16][4];
+
+    bc7_palette(endpoints, palette);
+
+    int error = 0;
+
+    for(int k = 0; k < 16; ++k)
+    {
+      indices[k] = nearest<4>(rgba[k], palette, 16);
+
+      for(int c = 0; c < 4; ++c)
+        error += (rgba[k][c] - palette[indices[k]][c]) * (rgba[k][c] - palette[indices[k]][c]);
+    }
+
+    return error;
+  }
+
+
+  ///////////////////////// encode_bc7 ////////////////////////////////////////
+  void encode_bc7(uint8_t const rgba[16][4], uint8_t *dst)
+  {
+    // mode 6, a single rgba line with 7 bit endpoints, p-bits and 4 bit indices
+
+    static const float weights[16] = { 0/64.0f, 4/64.0f, 9/64.0f, 13/64.0f, 17/64.0f, 21/64.0f, 26/64.0f, 30/64.0f, 34/64.0f, 38/64.0f, 43/64.0f, 47/64.0f, 51/64.0f, 55/64.0f, 60/64.0f, 64/64.0f };
+
+    float mean[4], axis[4], extents[2][4];
+
+    principal_axis<4>(rgba, nullptr, mean, axis);
+
+    project_extents<4>(rgba, nullptr, mean, axis, extents[0], extents[1]);
+
+    int quantised[2][4];
+    int pbits[2];
+    int indices[16];
+
+    int error = fit_bc7(rgba, extents, quantised, pbits, indices);
+
+    for(int iteration = 0; iteration < 2 && error != 0; ++iteration)
+    {
+      int trialquantised[2][4];
+      int trialpbits[2];
+      int trialindices[16];
+
+      if (!refine_endpoints<4>(rgba, nullptr, indices, weights, extents))
+        break;
+
+      int trialerror = fit_bc7(rgba, extents, trialquantised, trialpbits, trialindices);
+
+      if (trialerror >= error)
+        break;
+
+      error = trialerror;
+
+      memcpy(quantised, trialquantised, sizeof(quantised));
+      memcpy(pbits, trialpbits, sizeof(pbits));
+      memcpy(indices, trialindices, sizeof(indices));
+    }
+
+    // the anchor index is stored without its high bit
+
+    if (indices[0] & 8)
+    {
+      swap(quantised[0], quantised[1]);
+      swap(pbits[0], pbits[1]);
+
+      for(int k = 0; k < 16; ++k)
+        indices[k] = 15 - indices[k];
+    }
+
+    memset(dst, 0, 16);
+
+    int position = 0;
+
+    write_bits(dst, position, 1 << 6, 7);
+
+    for(int c = 0; c < 4; ++c)
+    {
+      write_bits(dst, position, quantised[0][c], 7);
+      write_bits(dst, position, quantised[1][c], 7);
+    }
+
+    write_bits(dst, position, pbits[0], 1);
+    write_bits(dst, position, pbits[1], 1);
+
+    write_bits(dst, position, indices[0], 3);
+
+    for(int k = 1; k < 16; ++k)
+      write_bits(dst, position, indices[k], 4);
+  }
+
+
+  ///////////////////////// decode_bc7 ////////////////////////////////////////
+  bool decode_bc7(uint8_t const *src, uint8_t rgba[16][4])
+  {
+    if ((src[0] & 0x7F) != 0x40)
+    {
+      memset(rgba, 0, 16*4);
+
+      return false;
+    }
+
+    int position = 7;
+
+    int endpoints[2][4];
+
+    for(int c = 0; c < 4; ++c)
+    {
+      endpoints[0][c] = read_bits(src, position, 7) << 1;
+      endpoints[1][c] = read_bits(src, position, 7) << 1;
+    }
+
+    int p0 = read_bits(src, position, 1);
+    int p1 = read_bits(src, position, 1);
+
+    for(int c = 0; c < 4; ++c)
+    {
+      endpoints[0][c] |= p0;
+      endpoints[1][c] |= p1;
+    }
+
+    int palette[16][4];
+
+    bc7_palette(endpoints, palette);
+
+    for(int k = 0; k < 16; ++k)
+    {
+      int index = read_bits(src, position, (k == 0) ? 3 : 4);
+
+      for(int c = 0; c < 4; ++c)
+        rgba[k][c] = palette[index][c];
+    }
+
+    return true;
+  }
+}
+
+
+///////////////////////// block_compressed_size /////////////////////////////
+size_t block_compressed_size(BlockFormat format, int width, int height)
+{
+  return size_t((width + 3) / 4) * size_t((height + 3) / 4) * block_size(format);
+}
+
+
+///////////////////////// block_compress ////////////////////////////////////
+void block_compress(BlockFormat format, void const *bgra, int width, int height, int firstrow, int lastrow, void *dst)
+{
+  auto src = static_cast<uint8_t const *>(bgra);
+
+  int blocksx = (width + 3) / 4;
+
+  auto out = static_cast<uint8_t*>(dst) + size_t(firstrow) * blocksx * block_size(format);
+
+  uint8_t rgba[16][4];
+
+  for(int by = firstrow; by < lastrow; ++by)
+  {
+    for(int bx = 0; bx < blocksx; ++bx)
+    {
+      load_block(src, width, height, bx, by, rgba);
+
+      switch (format)
+      {
+        case BlockFormat::BC1:
+          encode_color(rgba, true, false, out);
+          break;
+
+        case BlockFormat::BC3:
+          encode_alpha(rgba, out);
+          encode_color(rgba, false, true, out + 8);
+          break;
+
+        case BlockFormat::BC7:
+          encode_bc7(rgba, out);
+          break;
+      }
+
+      out += block_size(format);
+    }
+  }
+}
+
+
+///////////////////////// block_decompress //////////////////////////////////
+bool block_decompress(BlockFormat format, void const *src, int width, int height, void *bgra)
+{
+  auto in = static_cast<uint8_t const *>(src);
+  auto out = static_cast<uint8_t*>(bgra);
+
+  bool result = true;
+
+  uint8_t rgba[16][4];
+
+  for(int by = 0; by < (height + 3) / 4; ++by)
+  {
+    for(int bx = 0; bx < (width + 3) / 4; ++bx)
+    {
+      switch (format)
+      {
+        case BlockFormat::BC1:
+          decode_color(in, false, rgba);
+          break;
+
+        case BlockFormat::BC3:
+          decode_color(in + 8, true, rgba);
+          decode_alpha(in, rgba);
+
+          // colour and alpha are fitted apart, keep the colour premultiplied
+
+          for(int k = 0; k < 16; ++k)
+            for(int c = 0; c < 3; ++c)
+              rgba[k][c] = min(rgba[k][c], rgba[k][3]);
+          break;
+
+        case BlockFormat::BC7:
+          result &= decode_bc7(in, rgba);
+          break;
+      }
+
+      store_block(rgba, width, height, bx, by, out);
+
+      in += block_size(format);
+    }
+  }
+
+  return result;
+}
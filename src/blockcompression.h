@@ -0,0 +1,35 @@
+//
+// Handmade Hero - block compression
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+//|---------------------- bcn -----------------------------------------------
+//|--------------------------------------------------------------------------
+
+enum class BlockFormat
+{
+  BC1,  // rgb 565, punch through alpha
+  BC3,  // rgb 565, interpolated alpha
+  BC7,  // rgba, mode 6 only
+};
+
+// Compressed size of a width x height image, partial blocks round up
+std::size_t block_compressed_size(BlockFormat format, int width, int height);
+
+// Encode block rows [firstrow, lastrow) of a premultiplied bgra image into
+// the compressed image at dst. Distinct rows may be encoded concurrently.
+void block_compress(BlockFormat format, void const *bgra, int width, int height, int firstrow, int lastrow, void *dst);
+
+// Decode to premultiplied bgra, false if a block uses an unsupported mode.
+// BC3 colour is clamped to its alpha, which it is not fitted against.
+bool block_decompress(BlockFormat format, void const *src, int width, int height, void *bgra);
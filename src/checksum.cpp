@@ -0,0 +1,133 @@
+//
+// Handmade Hero - checksum
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#include "checksum.h"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <nmmintrin.h>
+# define HAVE_SSE42_CRC32
+#endif
+
+using namespace std;
+
+namespace
+{
+  const uint32_t Polynomial = 0x82f63b78; // reversed castagnoli
+
+  struct SliceTable
+  {
+    SliceTable()
+    {
+      for(uint32_t i = 0; i < 256; ++i)
+      {
+        uint32_t crc = i;
+
+        for(int k = 0; k < 8; ++k)
+          crc = (crc >> 1) ^ (Polynomial & (0 - (crc & 1)));
+
+        table[0][i] = crc;
+      }
+
+      for(uint32_t i = 0; i < 256; ++i)
+      {
+        for(int k = 1; k < 8; ++k)
+          table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+      }
+    }
+
+    uint32_t table[8][256];
+  };
+
+
+  ///////////////////////// crc32c_slice8 /////////////////////////////////////
+  uint32_t crc32c_slice8(uint32_t crc, uint8_t const *ptr, size_t n)
+  {
+    static const SliceTable slice;
+
+    auto &table = slice.table;
+
+    for( ; n >= 8; n -= 8, ptr += 8)
+    {
+      uint32_t lo, hi;
+
+      memcpy(&lo, ptr, sizeof(lo));
+      memcpy(&hi, ptr + 4, sizeof(hi));
+
+      lo ^= crc;
+
+      crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+          ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+
+    for( ; n != 0; --n, ++ptr)
+      crc = (crc >> 8) ^ table[0][(crc ^ *ptr) & 0xff];
+
+    return crc;
+  }
+
+
+#ifdef HAVE_SSE42_CRC32
+
+  ///////////////////////// crc32c_sse42 //////////////////////////////////////
+  __attribute__((target("sse4.2")))
+  uint32_t crc32c_sse42(uint32_t crc, uint8_t const *ptr, size_t n)
+  {
+    for( ; n != 0 && (reinterpret_cast<uintptr_t>(ptr) & 7) != 0; --n, ++ptr)
+      crc = _mm_crc32_u8(crc, *ptr);
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for( ; n >= 32; n -= 32, ptr += 32)
+    {
+      crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<uint64_t const *>(ptr));
+      crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<uint64_t const *>(ptr + 8));
+      crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<uint64_t const *>(ptr + 16));
+      crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<uint64_t const *>(ptr + 24));
+    }
+
+    for( ; n >= 8; n -= 8, ptr += 8)
+      crc64 = _mm_crc32_u64(crc64, *reinterpret_cast<uint64_t const *>(ptr));
+
+    crc = static_cast<uint32_t>(crc64);
+#endif
+
+    for( ; n >= 4; n -= 4, ptr += 4)
+      crc = _mm_crc32_u32(crc, *reinterpret_cast<uint32_t const *>(ptr));
+
+    for( ; n != 0; --n, ++ptr)
+      crc = _mm_crc32_u8(crc, *ptr);
+
+    return crc;
+  }
+
+#endif
+
+
+  ///////////////////////// select_crc32c /////////////////////////////////////
+  auto select_crc32c() -> uint32_t (*)(uint32_t, uint8_t const *, size_t)
+  {
+#ifdef HAVE_SSE42_CRC32
+    if (__builtin_cpu_supports("sse4.2"))
+      return crc32c_sse42;
+#endif
+
+    return crc32c_slice8;
+  }
+}
+
+
+///////////////////////// crc32c ////////////////////////////////////////////
+uint32_t crc32c(void const *data, size_t n, uint32_t crc)
+{
+  static const auto impl = select_crc32c();
+
+  return ~impl(~crc, static_cast<uint8_t const *>(data), n);
+}
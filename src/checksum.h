@@ -0,0 +1,21 @@
+//
+// Handmade Hero - checksum
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+//|---------------------- crc32c --------------------------------------------
+//|--------------------------------------------------------------------------
+
+// CRC-32C (Castagnoli), uses the SSE4.2 crc32 instruction when the cpu has
+// it. Pass a previous result as crc to continue a running checksum.
+uint32_t crc32c(void const *data, std::size_t n, uint32_t crc = 0);
@@ -0,0 +1,259 @@
+//
+// Handmade Hero - compression
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#include "compression.h"
+#include <memory>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+  const int HashLog = 16;
+
+  const size_t MinMatch = 4;
+  const size_t LastLiterals = 5;
+  const size_t MatchFindLimit = 12;
+  const size_t MaxOffset = 65535;
+
+  ///////////////////////// read32 ////////////////////////////////////////////
+  inline uint32_t read32(uint8_t const *ptr)
+  {
+    uint32_t value;
+
+    memcpy(&value, ptr, sizeof(value));
+
+    return value;
+  }
+
+
+  ///////////////////////// hash4 ///////////////////////////////////////////
+  inline uint32_t hash4(uint32_t sequence)
+  {
+    return (sequence * 2654435761u) >> (32 - HashLog);
+  }
+
+
+  ///////////////////////// write_length //////////////////////////////////////
+  inline uint8_t *write_length(uint8_t *op, size_t length)
+  {
+    for( ; length >= 255; length -= 255)
+      *op++ = 255;
+
+    *op++ = static_cast<uint8_t>(length);
+
+    return op;
+  }
+
+
+  ///////////////////////// read_length ///////////////////////////////////////
+  inline bool read_length(uint8_t const *&ip, uint8_t const *iend, size_t &length)
+  {
+    uint8_t byte;
+
+    do
+    {
+      if (ip == iend)
+        return false;
+
+      byte = *ip++;
+
+      length += byte;
+
+    } while (byte == 255);
+
+    return true;
+  }
+
+
+  ///////////////////////// write_sequence ////////////////////////////////////
+  inline uint8_t *write_sequence(uint8_t *op, uint8_t *oend, uint8_t const *literals, size_t literallength, size_t offset, size_t matchlength)
+  {
+    if (literallength + literallength/255 + matchlength/255 + 8 > size_t(oend - op))
+      return nullptr;
+
+    auto token = op++;
+
+    *token = static_cast<uint8_t>(min(literallength, size_t(15)) << 4);
+
+    if (literallength >= 15)
+      op = write_length(op, literallength - 15);
+
+    memcpy(op, literals, literallength);
+
+    op += literallength;
+
+    if (offset != 0)
+    {
+      *op++ = static_cast<uint8_t>(offset);
+      *op++ = static_cast<uint8_t>(offset >> 8);
+
+      matchlength -= MinMatch;
+
+      *token |= static_cast<uint8_t>(min(matchlength, size_t(15)));
+
+      if (matchlength >= 15)
+        op = write_length(op, matchlength - 15);
+    }
+
+    return op;
+  }
+}
+
+
+///////////////////////// lz4_compress_bound ////////////////////////////////
+size_t lz4_compress_bound(size_t n)
+{
+  return n + n/255 + 16;
+}
+
+
+///////////////////////// lz4_compress //////////////////////////////////////
+size_t lz4_compress(void const *src, size_t n, void *dst, size_t capacity)
+{
+  auto in = static_cast<uint8_t const *>(src);
+  auto out = static_cast<uint8_t*>(dst);
+
+  auto ip = in;
+  auto anchor = in;
+  auto iend = in + n;
+
+  auto op = out;
+  auto oend = out + capacity;
+
+  if (n > MatchFindLimit)
+  {
+    unique_ptr<uint32_t[]> table(new uint32_t[1 << HashLog]());
+
+    auto matchlimit = iend - LastLiterals;
+    auto mflimit = iend - MatchFindLimit;
+
+    while (ip < mflimit)
+    {
+      auto sequence = read32(ip);
+
+      auto &entry = table[hash4(sequence)];
+
+      auto match = in + entry;
+
+      entry = ip - in;
+
+      if (match < ip && size_t(ip - match) <= MaxOffset && read32(match) == sequence)
+      {
+        while (ip > anchor && match > in && ip[-1] == match[-1])
+        {
+          --ip;
+          --match;
+        }
+
+        size_t length = MinMatch;
+
+        while (ip + length < matchlimit && ip[length] == match[length])
+          ++length;
+
+        op = write_sequence(op, oend, anchor, ip - anchor, ip - match, length);
+
+        if (!op)
+          return 0;
+
+        ip += length;
+        anchor = ip;
+
+        if (ip < mflimit)
+          table[hash4(read32(ip - 2))] = ip - 2 - in;
+      }
+      else
+      {
+        // step faster through incompressible data
+
+        ip += 1 + ((ip - anchor) >> 6);
+      }
+    }
+  }
+
+  op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+
+  if (!op)
+    return 0;
+
+  return op - out;
+}
+
+
+///////////////////////// lz4_decompress ////////////////////////////////////
+bool lz4_decompress(void const *src, size_t n, void *dst, size_t size)
+{
+  auto ip = static_cast<uint8_t const *>(src);
+  auto iend = ip + n;
+
+  auto out = static_cast<uint8_t*>(dst);
+
+  auto op = out;
+  auto oend = out + size;
+
+  // copies are exact (never past the current sequence) so that the source
+  // may sit at the tail of the destination buffer
+
+  while (ip < iend)
+  {
+    auto token = *ip++;
+
+    size_t literallength = token >> 4;
+
+    if (literallength == 15 && !read_length(ip, iend, literallength))
+      return false;
+
+    if (literallength > size_t(iend - ip) || literallength > size_t(oend - op))
+      return false;
+
+    memmove(op, ip, literallength);
+
+    op += literallength;
+    ip += literallength;
+
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return false;
+
+    size_t offset = ip[0] | (ip[1] << 8);
+
+    ip += 2;
+
+    if (offset == 0 || offset > size_t(op - out))
+      return false;
+
+    size_t matchlength = token & 15;
+
+    if (matchlength == 15 && !read_length(ip, iend, matchlength))
+      return false;
+
+    matchlength += MinMatch;
+
+    if (matchlength > size_t(oend - op))
+      return false;
+
+    auto match = op - offset;
+
+    if (offset >= matchlength)
+    {
+      memcpy(op, match, matchlength);
+
+      op += matchlength;
+    }
+    else
+    {
+      for(size_t i = 0; i < matchlength; ++i)
+        *op++ = *match++;
+    }
+  }
+
+  return op == oend;
+}
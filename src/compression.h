@@ -0,0 +1,34 @@
+//
+// Handmade Hero - compression
+//
+
+//
+// Copyright (c) 2015 Peter Niekamp
+//   following Casey Muratori's Handmade Hero (handmadehero.org)
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+//|---------------------- lz4 -----------------------------------------------
+//|--------------------------------------------------------------------------
+
+// Block compressor producing the lz4 block format. Returns the compressed
+// size, or zero if the result would not fit in capacity bytes.
+std::size_t lz4_compress(void const *src, std::size_t n, void *dst, std::size_t capacity);
+
+// Worst case compressed size
+std::size_t lz4_compress_bound(std::size_t n);
+
+// Decompress exactly size bytes, false on malformed input.
+bool lz4_decompress(void const *src, std::size_t n, void *dst, std::size_t size);
+
+// Extra bytes needed to decompress in place, with the compressed data
+// placed at the end of a buffer of size + margin bytes.
+inline std::size_t lz4_inplace_margin(std::size_t size)
+{
+  return (size >> 8) + 32;
+}
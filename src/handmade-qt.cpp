@@ -15,6 +15,7 @@
 #include <QLibrary>
 #include <QElapsedTimer>
 #include <QKeyEvent>
+#include <QResizeEvent>
 #include <QFileInfo>
 #include <QDateTime>
 #include <QThread>
@@ -72,6 +73,8 @@ class Game
 
     void render();
 
+    void resize(int width, int height);
+
     void terminate();
 
   public:
@@ -206,6 +209,14 @@ void Game::render()
 }
 
 
+///////////////////////// Game::resize //////////////////////////////////////
+void Game::resize(int width, int height)
+{
+  m_platform.renderwidth = width;
+  m_platform.renderheight = height;
+}
+
+
 ///////////////////////// Game::terminate ///////////////////////////////////
 void Game::terminate()
 {
@@ -243,6 +254,8 @@ HandmadeWindow::HandmadeWindow(Game *game)
   create();
 
   show();
+
+  m_game->resize(width() * devicePixelRatio(), height() * devicePixelRatio());
 }
 
 
@@ -262,6 +275,15 @@ bool HandmadeWindow::event(QEvent *event)
         break;
       }
 
+    case QEvent::Resize:
+      {
+        auto resizeevent = static_cast<QResizeEvent*>(event);
+
+        m_game->resize(resizeevent->size().width() * devicePixelRatio(), resizeevent->size().height() * devicePixelRatio());
+
+        break;
+      }
+
     case QEvent::KeyPress:
       {
         auto keyevent = static_cast<QKeyEvent*>(event);
@@ -10,6 +10,8 @@
 #include "handmade.h"
 #include "rendergroup.h"
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 using namespace std;
@@ -35,7 +37,18 @@ extern "C" void game_init(PlatformInterface &platform)
 
   state.entropy.seed(random_device()());
 
+  // payload checksums are checked as they load, HANDMADE_ASSET_VERIFY=0 skips them
+
+  auto verify = getenv("HANDMADE_ASSET_VERIFY");
+
+  state.assets.verify_payloads(!verify || strcmp(verify, "0") != 0);
+
   initialise_asset_system(platform, state.assets);
+
+  // trace first use of each asset for the pack builder, see --trace
+
+  if (auto path = getenv("HANDMADE_ASSET_TRACE"))
+    state.assets.record_trace(platform, path);
 }
 
 
@@ -61,6 +74,8 @@ extern "C" void game_render(PlatformInterface &platform)
 {
   GameState &state = *static_cast<GameState*>(platform.gamememory.data);
 
+  state.assets.compact();
+
   RenderGroup rendergroup(platform, &state.assets, platform.renderscratchmemory, 1*1024*1024);
 
   rendergroup.projection(-11.0f, -6.0f, 11.0f, 6.0f, 0.6f/8.0f);
@@ -102,12 +117,16 @@ extern "C" void game_render(PlatformInterface &platform)
 
   RenderGroup debuggroup(platform, &state.assets, platform.renderscratchmemory, 1*1024*1024);
 
-  debuggroup.projection(0, 0, 960, 540, 0);
+  debuggroup.projection(0, 0, platform.renderwidth, platform.renderheight, 0);
 
   auto font = state.assets.find(AssetType::Font);
 
   debuggroup.push_text(Vec3(0, 0.0f, 0.0f), 64, font, "Hello World");
-  debuggroup.push_text(Vec3(0, font->ascent + font->descent + font->leading, 0.0f), 64, font, "WA To iyjgf");
+  auto &fontinfo = state.assets.info(font);
+
+  debuggroup.push_text(Vec3(0, fontinfo.ascent + fontinfo.descent + fontinfo.leading, 0.0f), 64, font, "WA To iyjgf");
 
   render(platform, debuggroup);
+
+  state.assets.flush(platform);
 }
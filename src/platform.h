@@ -75,13 +75,33 @@ namespace HandmadePlatform
       GameMemory gamescratchmemory;
       GameMemory renderscratchmemory;
 
+      // size of the render target in pixels, kept current by the platform
+      int renderwidth;
+      int renderheight;
+
 
       // data access
 
       typedef void *handle_t;
 
+      enum class OpenMode
+      {
+        Read,
+        Write,
+      };
+
+      // returns null if the file cannot be opened
+      virtual handle_t open_handle(const char *path, OpenMode mode) = 0;
+
+      virtual void stat_handle(handle_t handle, uint64_t *size, uint64_t *modified) = 0;
+
       virtual void read_handle(handle_t handle, uint64_t position, void *buffer, std::size_t n) = 0;
 
+      // async read, func is called on a worker thread once the data has arrived
+      virtual void read_handle(handle_t handle, uint64_t position, void *buffer, std::size_t n, void (*func)(PlatformInterface &, void*, void*), void *ldata, void *rdata) = 0;
+
+      virtual void write_handle(handle_t handle, uint64_t position, void const *buffer, std::size_t n) = 0;
+
       virtual void close_handle(handle_t handle) = 0;
 
 
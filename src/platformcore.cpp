@@ -10,6 +10,17 @@
 #include "platformcore.h"
 #include <memory>
 #include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -212,6 +223,288 @@ namespace HandmadePlatform
 
 
 
+  //|---------------------- IOQueue -----------------------------------------
+  //|------------------------------------------------------------------------
+
+#ifdef __linux__
+
+  ///////////////////////// IOQueue::Constructor ////////////////////////////
+  IOQueue::IOQueue(int depth)
+  {
+    m_inflight = 0;
+    m_capacity = 0;
+
+    m_sqring = m_cqring = m_sqes = MAP_FAILED;
+
+    io_uring_params params = {};
+
+    m_ringfd = syscall(__NR_io_uring_setup, depth, &params);
+
+    if (m_ringfd < 0)
+      return;
+
+    // IORING_OP_READ arrived alongside FAST_POLL (5.6/5.7), older kernels take the fallback
+
+    if (!(params.features & IORING_FEAT_FAST_POLL))
+    {
+      close(m_ringfd);
+
+      m_ringfd = -1;
+
+      return;
+    }
+
+    m_sqringsize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    m_cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_sqessize = params.sq_entries * sizeof(io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      m_sqringsize = m_cqringsize = max(m_sqringsize, m_cqringsize);
+
+    m_sqring = mmap(0, m_sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      m_cqring = m_sqring;
+    else
+      m_cqring = mmap(0, m_cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_CQ_RING);
+
+    m_sqes = mmap(0, m_sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+
+    if (m_sqring == MAP_FAILED || m_cqring == MAP_FAILED || m_sqes == MAP_FAILED)
+    {
+      if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqessize);
+
+      if (m_cqring != MAP_FAILED && m_cqring != m_sqring)
+        munmap(m_cqring, m_cqringsize);
+
+      if (m_sqring != MAP_FAILED)
+        munmap(m_sqring, m_sqringsize);
+
+      close(m_ringfd);
+
+      m_ringfd = -1;
+
+      return;
+    }
+
+    // never more reads in flight than completions the cq can hold, less one for the shutdown nop
+
+    m_capacity = params.cq_entries - 1;
+
+    auto sqring = static_cast<char*>(m_sqring);
+
+    m_sqhead = reinterpret_cast<uint32_t*>(sqring + params.sq_off.head);
+    m_sqtail = reinterpret_cast<uint32_t*>(sqring + params.sq_off.tail);
+    m_sqmask = *reinterpret_cast<uint32_t*>(sqring + params.sq_off.ring_mask);
+
+    auto sqarray = reinterpret_cast<uint32_t*>(sqring + params.sq_off.array);
+
+    for(uint32_t i = 0; i <= m_sqmask; ++i)
+      sqarray[i] = i;
+
+    m_thread = std::thread([=]() {
+
+      auto cqring = static_cast<char*>(m_cqring);
+
+      auto cqhead = reinterpret_cast<uint32_t*>(cqring + params.cq_off.head);
+      auto cqtail = reinterpret_cast<uint32_t*>(cqring + params.cq_off.tail);
+      auto cqmask = *reinterpret_cast<uint32_t*>(cqring + params.cq_off.ring_mask);
+      auto cqes = reinterpret_cast<io_uring_cqe*>(cqring + params.cq_off.cqes);
+
+      bool done = false;
+
+      while (!done)
+      {
+        int result = syscall(__NR_io_uring_enter, m_ringfd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+        if (result < 0 && errno != EINTR)
+        {
+          cerr << "IOQueue Error: " << strerror(errno) << endl;
+          break;
+        }
+
+        uint32_t head = *cqhead;
+        uint32_t tail = __atomic_load_n(cqtail, __ATOMIC_ACQUIRE);
+
+        for( ; head != tail; ++head)
+        {
+          auto &cqe = cqes[head & cqmask];
+
+          auto request = reinterpret_cast<Request*>(cqe.user_data);
+
+          if (!request)
+          {
+            done = true;
+            continue;
+          }
+
+          if (cqe.res == -EINTR || cqe.res == -EAGAIN || (cqe.res > 0 && (size_t)cqe.res < request->n))
+          {
+            // interrupted or short read, resubmit the remainder (keeps its inflight slot)
+
+            if (cqe.res > 0)
+            {
+              request->position += cqe.res;
+              request->buffer += cqe.res;
+              request->n -= cqe.res;
+            }
+
+            {
+              lock_guard<mutex> lock(m_mutex);
+
+              if (submit(request))
+                continue;
+
+              m_inflight -= 1;
+
+              m_signal.notify_all();
+            }
+
+            request->callback(false);
+
+            delete request;
+
+            continue;
+          }
+
+          {
+            lock_guard<mutex> lock(m_mutex);
+
+            m_inflight -= 1;
+
+            m_signal.notify_all();
+          }
+
+          request->callback(cqe.res >= 0 && (size_t)cqe.res == request->n);
+
+          delete request;
+        }
+
+        __atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+      }
+
+    });
+  }
+
+
+  ///////////////////////// IOQueue::Destructor /////////////////////////////
+  IOQueue::~IOQueue()
+  {
+    if (m_ringfd < 0)
+      return;
+
+    {
+      unique_lock<std::mutex> lock(m_mutex);
+
+      submit(nullptr);
+    }
+
+    m_thread.join();
+
+    munmap(m_sqes, m_sqessize);
+
+    if (m_cqring != m_sqring)
+      munmap(m_cqring, m_cqringsize);
+
+    munmap(m_sqring, m_sqringsize);
+
+    close(m_ringfd);
+  }
+
+
+  ///////////////////////// IOQueue::push ///////////////////////////////////
+  void IOQueue::push(Request *request)
+  {
+    {
+      unique_lock<std::mutex> lock(m_mutex);
+
+      while (m_inflight >= m_capacity)
+      {
+        m_signal.wait(lock);
+      }
+
+      m_inflight += 1;
+
+      if (submit(request))
+        return;
+
+      m_inflight -= 1;
+
+      m_signal.notify_all();
+    }
+
+    request->callback(false);
+
+    delete request;
+  }
+
+
+  ///////////////////////// IOQueue::submit /////////////////////////////////
+  bool IOQueue::submit(Request *request)
+  {
+    uint32_t tail = *m_sqtail;
+
+    auto &sqe = static_cast<io_uring_sqe*>(m_sqes)[tail & m_sqmask];
+
+    memset(&sqe, 0, sizeof(sqe));
+
+    if (request)
+    {
+      sqe.opcode = IORING_OP_READ;
+      sqe.fd = request->fd;
+      sqe.off = request->position;
+      sqe.addr = reinterpret_cast<uintptr_t>(request->buffer);
+      sqe.len = request->n;
+    }
+    else
+    {
+      sqe.opcode = IORING_OP_NOP;
+    }
+
+    sqe.user_data = reinterpret_cast<uintptr_t>(request);
+
+    __atomic_store_n(m_sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    // everything queued since the last enter goes to the kernel in the one call
+
+    while (int pending = tail + 1 - __atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE))
+    {
+      if (syscall(__NR_io_uring_enter, m_ringfd, pending, 0, 0, nullptr, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      {
+        cerr << "IOQueue Submit Error: " << strerror(errno) << endl;
+
+        // earlier entries were all consumed, so the one left is this request, take it back
+
+        __atomic_store_n(m_sqtail, tail, __ATOMIC_RELEASE);
+
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+#else
+
+  IOQueue::IOQueue(int depth)
+  {
+    m_ringfd = -1;
+  }
+
+  IOQueue::~IOQueue()
+  {
+  }
+
+  void IOQueue::push(Request *request)
+  {
+    throw runtime_error("IOQueue Unavailable");
+  }
+
+#endif
+
+
+
   //|---------------------- PlatformCore ------------------------------------
   //|------------------------------------------------------------------------
 
@@ -219,6 +512,9 @@ namespace HandmadePlatform
   ///////////////////////// PlatformCore::Constructor ///////////////////////
   PlatformCore::PlatformCore()
   {
+    renderwidth = 0;
+    renderheight = 0;
+
     m_terminaterequested = false;
   }
 
@@ -238,6 +534,53 @@ namespace HandmadePlatform
   }
 
 
+  ///////////////////////// PlatformCore::open_handle ///////////////////////
+  PlatformInterface::handle_t PlatformCore::open_handle(const char *path, OpenMode mode)
+  {
+    auto handle = new platform_handle_t;
+
+    handle->path = path;
+
+    switch (mode)
+    {
+      case OpenMode::Read:
+        handle->fio.open(path, ios::in | ios::binary);
+#ifdef __linux__
+        handle->fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+        break;
+
+      case OpenMode::Write:
+        handle->fio.open(path, ios::out | ios::binary | ios::trunc);
+        break;
+    }
+
+    if (!handle->fio)
+    {
+      close_handle(handle);
+
+      return nullptr;
+    }
+
+    return handle;
+  }
+
+
+  ///////////////////////// PlatformCore::stat_handle ///////////////////////
+  void PlatformCore::stat_handle(PlatformInterface::handle_t handle, uint64_t *size, uint64_t *modified)
+  {
+    auto file = static_cast<platform_handle_t*>(handle);
+
+    struct stat st;
+
+    if (stat(file->path.c_str(), &st) != 0)
+      throw runtime_error("Data Stat Error");
+
+    *size = st.st_size;
+    *modified = st.st_mtime;
+  }
+
+
   ///////////////////////// PlatformCore::read_handle ///////////////////////
   void PlatformCore::read_handle(PlatformInterface::handle_t handle, uint64_t position, void *buffer, size_t n)
   {
@@ -254,10 +597,86 @@ namespace HandmadePlatform
   }
 
 
+  ///////////////////////// PlatformCore::read_handle ///////////////////////
+  void PlatformCore::read_handle(PlatformInterface::handle_t handle, uint64_t position, void *buffer, size_t n, void (*func)(PlatformInterface &, void*, void*), void *ldata, void *rdata)
+  {
+    auto file = static_cast<platform_handle_t*>(handle);
+
+    if (m_ioqueue.available() && file->fd >= 0)
+    {
+      m_ioqueue.push(file->fd, position, buffer, n, [=](bool ok) {
+
+        m_workqueue.push([=]() {
+
+          if (!ok)
+          {
+            // the ring could not complete it, read it again the blocking way
+
+            try
+            {
+              read_handle(handle, position, buffer, n);
+            }
+            catch(exception &e)
+            {
+              cerr << "Background Read Error: " << e.what() << endl;
+            }
+          }
+
+          func(*this, ldata, rdata);
+
+        });
+
+      });
+    }
+    else
+    {
+      m_workqueue.push([=]() {
+
+        try
+        {
+          read_handle(handle, position, buffer, n);
+        }
+        catch(exception &e)
+        {
+          cerr << "Background Read Error: " << e.what() << endl;
+        }
+
+        func(*this, ldata, rdata);
+
+      });
+    }
+  }
+
+
+  ///////////////////////// PlatformCore::write_handle //////////////////////
+  void PlatformCore::write_handle(PlatformInterface::handle_t handle, uint64_t position, void const *buffer, size_t n)
+  {
+    auto file = static_cast<platform_handle_t*>(handle);
+
+    lock_guard<mutex> lock(file->lock);
+
+    file->fio.seekp(position);
+
+    file->fio.write((char const *)buffer, n);
+
+    file->fio.flush();
+
+    if (!file->fio)
+      throw runtime_error("Data Write Error");
+  }
+
+
   ///////////////////////// PlatformCore::close_handle //////////////////////
   void PlatformCore::close_handle(PlatformInterface::handle_t handle)
   {
-    delete static_cast<platform_handle_t*>(handle);
+    auto file = static_cast<platform_handle_t*>(handle);
+
+#ifdef __linux__
+    if (file->fd >= 0)
+      close(file->fd);
+#endif
+
+    delete file;
   }
 
 
@@ -286,7 +705,13 @@ namespace HandmadePlatform
       {
         handle = new platform_handle_t;
 
-        handle->fio.open(directory->iterator->string(), ios::in | ios::binary);
+        handle->path = directory->iterator->string();
+
+        handle->fio.open(handle->path, ios::in | ios::binary);
+
+#ifdef __linux__
+        handle->fd = open(handle->path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
       }
 
       ++directory->iterator;
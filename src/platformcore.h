@@ -106,6 +106,73 @@ namespace HandmadePlatform
 
 
 
+  //|---------------------- IOQueue -------------------------------------------
+  //|--------------------------------------------------------------------------
+
+  // io_uring backed asynchronous reads. available() is false where the kernel
+  // (or the platform) has no io_uring, callers must then fall back to blocking
+  // reads on the WorkQueue. Requests the ring fails to submit complete with
+  // failure rather than throwing.
+
+  class IOQueue
+  {
+    public:
+
+      IOQueue(int depth = 256);
+      ~IOQueue();
+
+      bool available() const { return m_ringfd >= 0; }
+
+      template<typename Func>
+      void push(int fd, uint64_t position, void *buffer, std::size_t n, Func &&func)
+      {
+        push(new Request{ fd, position, static_cast<char*>(buffer), n, std::forward<Func>(func) });
+      }
+
+    private:
+
+      struct Request
+      {
+        int fd;
+        uint64_t position;
+        char *buffer;
+        std::size_t n;
+
+        std::function<void(bool)> callback;
+      };
+
+      void push(Request *request);
+
+      bool submit(Request *request);
+
+    private:
+
+      int m_ringfd;
+
+      uint32_t *m_sqhead;
+      uint32_t *m_sqtail;
+      uint32_t m_sqmask;
+
+      void *m_sqring;
+      void *m_cqring;
+      void *m_sqes;
+
+      std::size_t m_sqringsize;
+      std::size_t m_cqringsize;
+      std::size_t m_sqessize;
+
+      std::size_t m_inflight;
+      std::size_t m_capacity;
+
+      std::mutex m_mutex;
+
+      std::condition_variable m_signal;
+
+      std::thread m_thread;
+  };
+
+
+
   //|---------------------- PlatformCore --------------------------------------
   //|--------------------------------------------------------------------------
 
@@ -126,10 +193,22 @@ namespace HandmadePlatform
         std::mutex lock;
 
         std::fstream fio;
+
+        std::string path;
+
+        int fd = -1;
       };
 
+      handle_t open_handle(const char *path, OpenMode mode) override;
+
+      void stat_handle(handle_t handle, uint64_t *size, uint64_t *modified) override;
+
       void read_handle(handle_t handle, uint64_t position, void *buffer, std::size_t n) override;
 
+      void read_handle(handle_t handle, uint64_t position, void *buffer, std::size_t n, void (*func)(PlatformInterface &, void*, void*), void *ldata, void *rdata) override;
+
+      void write_handle(handle_t handle, uint64_t position, void const *buffer, std::size_t n) override;
+
       void close_handle(handle_t handle) override;
 
 
@@ -170,6 +249,8 @@ namespace HandmadePlatform
       std::vector<char> m_renderscratchmemory;
 
       WorkQueue m_workqueue;
+
+      IOQueue m_ioqueue;
   };
 
 } // namespace
@@ -8,7 +8,9 @@
 //
 
 #include "renderer.h"
+#include "blockcompression.h"
 #include <vector>
+#include <cstring>
 #include <iostream>
 #include <GL/gl.h>
 #include <GL/glext.h>
@@ -17,12 +19,15 @@ typedef void (APIENTRYP PFNGLVIEWPORTPROC) (GLint x,GLint y,GLsizei width,GLsize
 
 typedef void (APIENTRYP PFNGLCLEARCOLORPROC) (GLclampf red,GLclampf green,GLclampf blue,GLclampf alpha);
 typedef void (APIENTRYP PFNGLCLEARPROC) (GLbitfield mask);
+typedef void (APIENTRYP PFNGLGETINTEGERVPROC) (GLenum pname, GLint *data);
 
 typedef void (APIENTRYP PFNGLGENTEXTURESPROC) (GLsizei n, GLuint *textures);
 typedef void (APIENTRYP PFNGLACTIVETEXTURE) (GLsizei n);
 typedef void (APIENTRYP PFNGLBINDTEXTUREPROC) (GLenum target, GLuint texture);
 typedef void (APIENTRYP PFNGLTEXIMAGE2DPROC) (GLenum target,GLint level,GLint internalformat,GLsizei width,GLsizei height,GLint border,GLenum format,GLenum type,const GLvoid *pixels);
 typedef void (APIENTRYP PFNGLTEXPARAMETERIPROC) (GLenum target,GLenum pname,GLint param);
+typedef void (APIENTRYP PFNGLTEXPARAMETERIVPROC) (GLenum target,GLenum pname,const GLint *params);
+typedef void (APIENTRYP PFNGLPIXELSTOREIPROC) (GLenum pname,GLint param);
 typedef void (APIENTRYP PFNGLDELETETEXTURESPROC) (GLsizei n,const GLuint *textures);
 
 typedef void (APIENTRYP PFNGLDRAWARRAYSPROC) (GLenum mode,GLint first,GLsizei count);
@@ -46,12 +51,13 @@ namespace
     attribute highp vec4 vertex_uv;
 
     uniform mediump mat4 transform;
+    uniform mediump vec4 region;
 
     varying mediump vec4 uv;
 
     void main(void)
     {
-      uv = vertex_uv;
+      uv = vec4(mix(region.xy, region.zw, vertex_uv.st), 0.0, 0.0);
       gl_Position = transform * vertex_pos;
     }
 
@@ -66,7 +72,11 @@ namespace
 
     void main()
     {
-      gl_FragColor = texture(diffuse, uv.st);
+      vec4 texel = texture(diffuse, uv.st);
+
+      // bc3 colour and alpha are fitted apart, keep the colour premultiplied
+
+      gl_FragColor = vec4(min(texel.rgb, texel.a), texel.a);
     }
 
   )";
@@ -78,6 +88,44 @@ namespace
     GLfloat data[4][4];
   };
 
+  struct Texture
+  {
+    GLuint texture;
+
+    void const *bits;
+  };
+
+  struct Capabilities
+  {
+    bool s3tc;
+    bool bptc;
+  };
+
+  Capabilities capabilities(HandmadePlatform::PlatformInterface &platform)
+  {
+    auto glGetIntegerv = (PFNGLGETINTEGERVPROC)platform.gl_request_proc("glGetIntegerv");
+    auto glGetStringi = (PFNGLGETSTRINGIPROC)platform.gl_request_proc("glGetStringi");
+
+    Capabilities result = {};
+
+    GLint count = 0;
+
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+
+    for(GLint i = 0; i < count; ++i)
+    {
+      auto name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+
+      if (strcmp(name, "GL_EXT_texture_compression_s3tc") == 0)
+        result.s3tc = true;
+
+      if (strcmp(name, "GL_ARB_texture_compression_bptc") == 0)
+        result.bptc = true;
+    }
+
+    return result;
+  }
+
   void identity(Transform *transform)
   {
     transform->data[0][0] = 1; transform->data[1][0] = 0; transform->data[2][0] = 0; transform->data[3][0] = 0;
@@ -175,7 +223,7 @@ namespace
   }
 
 
-  void draw_bitmap(HandmadePlatform::PlatformInterface &platform, Transform const &projection, Renderable::Bitmap const &bitmap)
+  void draw_bitmap(HandmadePlatform::PlatformInterface &platform, Capabilities const &caps, Transform const &projection, GLint regionuniform, Texture &current, Renderable::Bitmap const &bitmap)
   {
     auto transform = mulbybasis(projection, bitmap.xaxis, bitmap.yaxis, bitmap.origin);
 
@@ -188,31 +236,117 @@ namespace
 
     assert(glGenTextures && glBindTexture && glTexImage2D && glTexParameteri);
 
-    GLuint texture;
+    // consecutive bitmaps from the same bits (eg. glyphs of an atlas) reuse the upload
 
-    glGenTextures(1, &texture);
+    if (bitmap.bits != current.bits)
+    {
+      if (current.bits)
+        glDeleteTextures(1, &current.texture);
 
-    glBindTexture(GL_TEXTURE_2D, texture);
+      glGenTextures(1, &current.texture);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bitmap.width, bitmap.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, bitmap.bits);
+      glBindTexture(GL_TEXTURE_2D, current.texture);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      switch (bitmap.format)
+      {
+        case Renderable::Format::BGRA:
+          glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bitmap.width, bitmap.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, bitmap.bits);
+          break;
+
+        case Renderable::Format::A8:
+          {
+            // premultiplied white, sample the single channel into all four
+
+            auto glPixelStorei = (PFNGLPIXELSTOREIPROC)platform.gl_request_proc("glPixelStorei");
+            auto glTexParameteriv = (PFNGLTEXPARAMETERIVPROC)platform.gl_request_proc("glTexParameteriv");
+
+            GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_RED };
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, bitmap.width, bitmap.height, 0, GL_RED, GL_UNSIGNED_BYTE, bitmap.bits);
+
+            glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+          }
+          break;
+
+        case Renderable::Format::BC1:
+        case Renderable::Format::BC3:
+        case Renderable::Format::BC7:
+          {
+            GLenum internalformat;
+            BlockFormat blockformat;
+            bool supported;
+
+            switch (bitmap.format)
+            {
+              case Renderable::Format::BC1:
+                internalformat = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+                blockformat = BlockFormat::BC1;
+                supported = caps.s3tc;
+                break;
+
+              case Renderable::Format::BC3:
+                internalformat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+                blockformat = BlockFormat::BC3;
+                supported = caps.s3tc;
+                break;
+
+              default:
+                internalformat = GL_COMPRESSED_RGBA_BPTC_UNORM;
+                blockformat = BlockFormat::BC7;
+                supported = caps.bptc;
+                break;
+            }
+
+            if (supported)
+            {
+              auto glCompressedTexImage2D = (PFNGLCOMPRESSEDTEXIMAGE2DPROC)platform.gl_request_proc("glCompressedTexImage2D");
+
+              glCompressedTexImage2D(GL_TEXTURE_2D, 0, internalformat, bitmap.width, bitmap.height, 0, block_compressed_size(blockformat, bitmap.width, bitmap.height), bitmap.bits);
+            }
+            else
+            {
+              // no hardware decoder, expand to bgra in scratch memory
+
+              auto scratch = mark(platform.renderscratchmemory);
+
+              auto bits = allocate<uint32_t>(platform.renderscratchmemory, bitmap.width * bitmap.height);
+
+              if (!block_decompress(blockformat, bitmap.bits, bitmap.width, bitmap.height, bits))
+                cerr << "Render Error: Unsupported compressed block" << endl;
+
+              glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bitmap.width, bitmap.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, bits);
+
+              rewind(platform.renderscratchmemory, scratch);
+            }
+          }
+          break;
+      }
+
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+      current.bits = bitmap.bits;
+    }
 
     auto glUniformMatrix4fv = (PFNGLUNIFORMMATRIX4FVPROC)platform.gl_request_proc("glUniformMatrix4fv");;
+    auto glUniform4f = (PFNGLUNIFORM4FPROC)platform.gl_request_proc("glUniform4f");
 
     glUniformMatrix4fv(transform.uniform, 1, GL_FALSE, (GLfloat*)transform.data);
 
+    glUniform4f(regionuniform, bitmap.region.min.x, bitmap.region.min.y, bitmap.region.max.x, bitmap.region.max.y);
+
     auto glDrawArrays = (PFNGLDRAWARRAYSPROC)platform.gl_request_proc("glDrawArrays");
 
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glBindTexture(GL_TEXTURE_2D, current.texture);
 
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-
-    glDeleteTextures(1, &texture);
   }
 }
 
@@ -226,7 +360,7 @@ void render(HandmadePlatform::PlatformInterface &platform, PushBuffer const &ren
 
   auto glViewport = (PFNGLVIEWPORTPROC)platform.gl_request_proc("glViewport");
 
-  glViewport(0, 0, 960, 540);
+  glViewport(0, 0, platform.renderwidth, platform.renderheight);
 
   auto glCreateShader = (PFNGLCREATESHADERPROC)platform.gl_request_proc("glCreateShader");
   auto glShaderSource = (PFNGLSHADERSOURCEPROC)platform.gl_request_proc("glShaderSource");
@@ -329,11 +463,16 @@ void render(HandmadePlatform::PlatformInterface &platform, PushBuffer const &ren
 
   GLint diffuseuniform = glGetUniformLocation(program, "diffuse");
   GLint transformuniform = glGetUniformLocation(program, "transform");
+  GLint regionuniform = glGetUniformLocation(program, "region");
 
   glUseProgram(program);
 
   glUniform1i(diffuseuniform, 0);
 
+  auto glUniform4f = (PFNGLUNIFORM4FPROC)platform.gl_request_proc("glUniform4f");
+
+  glUniform4f(regionuniform, 0.0f, 0.0f, 1.0f, 1.0f);
+
   GLfloat verts[4][5] = {
     { 0.0, 1.0, 0.0, 0.0, 0.0 },
     { 0.0, 0.0, 0.0, 0.0, 1.0 },
@@ -400,6 +539,12 @@ void render(HandmadePlatform::PlatformInterface &platform, PushBuffer const &ren
 
   glUniformMatrix4fv(projection.uniform, 1, GL_FALSE, (GLfloat*)projection.data);
 
+  // extensions of the one context the platform renders with, scanned once
+
+  static const auto caps = capabilities(platform);
+
+  Texture current = {};
+
   for(auto &renderable : renderables)
   {
     switch (renderable.type)
@@ -418,15 +563,23 @@ void render(HandmadePlatform::PlatformInterface &platform, PushBuffer const &ren
         break;
 
       case Renderable::Type::Rect:
+        glUniform4f(regionuniform, 0.0f, 0.0f, 1.0f, 1.0f);
         draw_rect(platform, projection, *renderable_cast<Renderable::Rect>(&renderable));
         break;
 
       case Renderable::Type::Bitmap:
-        draw_bitmap(platform, projection, *renderable_cast<Renderable::Bitmap>(&renderable));
+        draw_bitmap(platform, caps, projection, regionuniform, current, *renderable_cast<Renderable::Bitmap>(&renderable));
         break;
     }
   }
 
+  if (current.bits)
+  {
+    auto glDeleteTextures = (PFNGLDELETETEXTURESPROC)platform.gl_request_proc("glDeleteTextures");
+
+    glDeleteTextures(1, &current.texture);
+  }
+
   // TODO: Again, not every frame
   glUseProgram(0);
   glDisableVertexAttribArray(0);
@@ -19,6 +19,7 @@ namespace Renderable
 {
   using Vec2 = lml::Vec2;
   using Vec3 = lml::Vec3;
+  using Rect2 = lml::Rect2;
   using Color4 = lml::Color4;
 
   enum class Type : uint16_t
@@ -29,6 +30,15 @@ namespace Renderable
     Bitmap,
   };
 
+  enum class Format : uint32_t // matches PackImageFormat
+  {
+    BGRA,
+    A8,
+    BC1,
+    BC3,
+    BC7,
+  };
+
   struct Camera
   {
     static const Type type = Type::Camera;
@@ -63,8 +73,11 @@ namespace Renderable
 
     int width;
     int height;
+    Format format;
     void const *bits;
 
+    Rect2 region; // uv sub-rectangle, bitmaps sharing bits share a texture
+
     Color4 color;
 
     Vec2 xaxis;
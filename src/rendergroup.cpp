@@ -9,11 +9,70 @@
 
 #include "rendergroup.h"
 #include "assetpack.h"
+#include <algorithm>
 #include <iostream>
 using namespace std;
 using namespace lml;
 using namespace HandmadePlatform;
 
+namespace
+{
+  ///////////////////////// decode_utf8 ///////////////////////////////////////
+  uint32_t decode_utf8(const char *&str)
+  {
+    static const uint32_t minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+    auto bytes = reinterpret_cast<uint8_t const *>(str);
+
+    uint32_t codepoint = 0;
+    int length;
+
+    if (bytes[0] < 0x80)
+    {
+      codepoint = bytes[0];
+      length = 1;
+    }
+    else if ((bytes[0] & 0xE0) == 0xC0)
+    {
+      codepoint = bytes[0] & 0x1F;
+      length = 2;
+    }
+    else if ((bytes[0] & 0xF0) == 0xE0)
+    {
+      codepoint = bytes[0] & 0x0F;
+      length = 3;
+    }
+    else if ((bytes[0] & 0xF8) == 0xF0)
+    {
+      codepoint = bytes[0] & 0x07;
+      length = 4;
+    }
+    else
+      length = 0;
+
+    for(int i = 1; i < length; ++i)
+    {
+      if ((bytes[i] & 0xC0) != 0x80)
+        length = 0;
+      else
+        codepoint = (codepoint << 6) | (bytes[i] & 0x3F);
+    }
+
+    // malformed, overlong or surrogate sequences consume a single byte
+
+    if (length == 0 || codepoint < minimum[length] || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF))
+    {
+      str += 1;
+
+      return 0xFFFD;
+    }
+
+    str += length;
+
+    return codepoint;
+  }
+}
+
 
 //|---------------------- RenderGroup ---------------------------------------
 //|--------------------------------------------------------------------------
@@ -57,6 +116,8 @@ void RenderGroup::projection(float left, float bottom, float right, float top, f
   }
 
   m_focallength = focallength;
+
+  m_pixelscale = m_platform.renderwidth / (right - left);
 }
 
 
@@ -96,8 +157,33 @@ void RenderGroup::push_rect(Vec3 const &position, Rect2 const &rect, Color4 cons
 }
 
 
+///////////////////////// RenderGroup::push_image ///////////////////////////
+void RenderGroup::push_image(Vec3 const &position, Vec2 const &dim, Vec2 const &align, int width, int height, Renderable::Format format, void const *bits, Rect2 const &region, Color4 const &color)
+{
+  auto entry = m_buffer.push<Renderable::Bitmap>();
+
+  if (entry)
+  {
+    float scale = projected_scale(position.z);
+
+    entry->width = width;
+    entry->height = height;
+    entry->format = format;
+    entry->bits = bits;
+
+    entry->region = region;
+
+    entry->color = color;
+
+    entry->xaxis = Vec2(scale * dim.x, 0.0f);
+    entry->yaxis = Vec2(0.0f, scale * dim.y);
+    entry->origin = scale * (position.xy - align);
+  }
+}
+
+
 ///////////////////////// RenderGroup::push_bitmap //////////////////////////
-void RenderGroup::push_bitmap(Vec3 const &position, float size, Asset const *bitmap, Color4 const &color)
+void RenderGroup::push_bitmap(Vec3 const &position, float size, AssetId bitmap, Color4 const &color)
 {
   if (position.z > 0.0)
     return;
@@ -105,35 +191,52 @@ void RenderGroup::push_bitmap(Vec3 const &position, float size, Asset const *bit
   if (!bitmap)
     return;
 
-  auto bits = m_assets->request(m_platform, bitmap);
+  auto &info = m_assets->info(bitmap);
 
-  if (bits)
+  auto dim = Vec2(size * info.aspect, size);
+  auto align = Vec2(info.alignx * dim.x, info.aligny * dim.y);
+
+  // smallest mip level still covering the on screen pixels
+
+  float pixels = projected_scale(position.z) * dim.x * m_pixelscale;
+
+  int level = 0;
+
+  while (level + 1 < info.levels && m_assets->info(m_assets->mip(bitmap, level + 1)).width >= pixels)
+    ++level;
+
+  auto image = m_assets->mip(bitmap, level);
+
+  auto bits = m_assets->request(m_platform, image);
+
+  // while it streams in draw the nearest coarser level already loaded,
+  // the coarsest is requested only when none is
+
+  for(int coarser = level + 1; !bits && coarser < info.levels; ++coarser)
   {
-    auto entry = m_buffer.push<Renderable::Bitmap>();
+    image = m_assets->mip(bitmap, coarser);
 
-    if (entry)
-    {
-      auto dim = Vec2(size * bitmap->aspect, size);
-      auto align = Vec2(bitmap->alignx * dim.x, bitmap->aligny * dim.y);
+    bits = m_assets->resident(image);
+  }
 
-      float scale = projected_scale(position.z);
+  if (!bits)
+  {
+    image = m_assets->mip(bitmap, info.levels - 1);
 
-      entry->width = bitmap->width;
-      entry->height = bitmap->height;
-      entry->bits = bits;
+    bits = m_assets->request(m_platform, image);
+  }
 
-      entry->color = color;
+  if (bits)
+  {
+    auto &imageinfo = m_assets->info(image);
 
-      entry->xaxis = Vec2(scale * dim.x, 0.0f);
-      entry->yaxis = Vec2(0.0f, scale * dim.y);
-      entry->origin = scale * (position.xy - align);
-    }
+    push_image(position, dim, align, imageinfo.width, imageinfo.height, static_cast<Renderable::Format>(imageinfo.format), bits, Rect2({ 0.0f, 0.0f }, { 1.0f, 1.0f }), color);
   }
 }
 
 
 ///////////////////////// RenderGroup::push_text ////////////////////////////
-void RenderGroup::push_text(Vec3 const &position, float size, Asset const *font, const char *str, Color4 const &color)
+void RenderGroup::push_text(Vec3 const &position, float size, AssetId font, const char *str, Color4 const &color)
 {
   if (position.z > 0.0)
     return;
@@ -141,36 +244,54 @@ void RenderGroup::push_text(Vec3 const &position, float size, Asset const *font,
   if (!font)
     return;
 
-  auto table = (PackFontPayload*)m_assets->request(m_platform, font);
+  auto typeface = m_assets->font(m_platform, font);
 
-  if (table)
+  if (typeface)
   {
-    auto glyphtable = reinterpret_cast<AssetType*>(reinterpret_cast<char*>(table) + sizeof(PackFontPayload));
-    auto kerningtable = reinterpret_cast<uint8_t*>(reinterpret_cast<char*>(table) + sizeof(PackFontPayload) + table->count * sizeof(uint32_t));
+    if (!typeface->atlas)
+      return;
+
+    auto bits = m_assets->request(m_platform, typeface->atlas);
 
-    auto scale = size / (font->ascent + font->descent);
+    if (!bits)
+      return;
+
+    auto &fontinfo = m_assets->info(font);
+    auto &atlasinfo = m_assets->info(typeface->atlas);
+
+    auto scale = size / (fontinfo.ascent + fontinfo.descent);
+
+    auto texelsize = Vec2(1.0f / atlasinfo.width, 1.0f / atlasinfo.height);
 
     auto cursor = position;
 
-    uint32_t othercodepoint = 0;
+    PackGlyph const *previous = nullptr;
 
-    for(const char *ch = str; *ch; ++ch)
+    for(const char *ch = str; *ch; )
     {
-      uint32_t codepoint = *ch;
+      auto glyph = typeface->glyph(decode_utf8(ch));
+
+      if (!glyph)
+        continue;
 
-      if (codepoint < table->count)
+      if (previous)
       {
-        cursor.x += scale * kerningtable[othercodepoint*table->count + codepoint];
+        cursor.x += scale * previous->advance;
 
-        auto glyph = m_assets->find(glyphtable[codepoint]);
+        cursor.x += scale * typeface->kern(previous, glyph);
+      }
+
+      if (glyph->width != 0)
+      {
+        auto dim = Vec2(scale * glyph->width, scale * glyph->height);
+        auto align = Vec2(glyph->alignx * dim.x, glyph->aligny * dim.y);
 
-        if (glyph)
-        {
-          push_bitmap(cursor, scale * glyph->height, glyph, color);
-        }
+        auto region = Rect2(Vec2(glyph->x * texelsize.x, glyph->y * texelsize.y), Vec2((glyph->x + glyph->width) * texelsize.x, (glyph->y + glyph->height) * texelsize.y));
 
-        othercodepoint = codepoint;
+        push_image(cursor, dim, align, atlasinfo.width, atlasinfo.height, static_cast<Renderable::Format>(atlasinfo.format), bits, region, color);
       }
+
+      previous = glyph;
     }
   }
 }
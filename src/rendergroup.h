@@ -41,9 +41,9 @@ class RenderGroup
 
     void push_rect(Vec3 const &position, Rect2 const &rect, Color4 const &color = { 1.0f, 1.0f, 1.0f, 1.0f });
 
-    void push_bitmap(Vec3 const &position, float size, Asset const *bitmap, Color4 const &color = { 1.0f, 1.0f, 1.0f, 1.0f });
+    void push_bitmap(Vec3 const &position, float size, AssetId bitmap, Color4 const &color = { 1.0f, 1.0f, 1.0f, 1.0f });
 
-    void push_text(Vec3 const &position, float size, Asset const *font, const char *str, Color4 const &color = { 1.0f, 1.0f, 1.0f, 1.0f });
+    void push_text(Vec3 const &position, float size, AssetId font, const char *str, Color4 const &color = { 1.0f, 1.0f, 1.0f, 1.0f });
 
     // Render
     friend void render(HandmadePlatform::PlatformInterface &platform, RenderGroup const &rendergroup);
@@ -52,6 +52,8 @@ class RenderGroup
 
     float projected_scale(float z) const;
 
+    void push_image(Vec3 const &position, Vec2 const &dim, Vec2 const &align, int width, int height, Renderable::Format format, void const *bits, Rect2 const &region, Color4 const &color);
+
   private:
 
     HandmadePlatform::PlatformInterface &m_platform;
@@ -62,6 +64,8 @@ class RenderGroup
 
     float m_focallength;
 
+    float m_pixelscale;
+
     PushBuffer m_buffer;
 };
 